@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Architecture definitions */
+#include "./include/main_memory.h"
+#include "./include/registers.h"
+
+/* Utility functions */
+#include "./include/utilities/switch_endian.h"
+#include "./include/utilities/read_image_file.h"
+
+/* Execution engines */
+#include "./include/engines/lockstep.h"
+
+#define PROGRAM_START 0x3000
+
+/*
+    lc3-batch: run one image over many input streams.
+
+    Every input file is replayed as the keyboard of its own VM instance. The VMs are
+    stepped LOCKSTEP_LANES at a time by the lockstep interpreter. The console output
+    of each instance is written to <input>.out and a summary line is printed per input.
+*/
+
+static void batch_usage(void)
+{
+    printf("lc3-batch [-n max-instructions] [image-file] ... -- [input-file] ...\n");
+    exit(2);
+}
+
+/* Read a whole file into a heap buffer. Returns NULL on FAILURE */
+static uint8_t* read_input_file(const char* path, size_t* length)
+{
+    FILE* file = fopen(path, "rb");
+    if( !file )
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* buffer = malloc(size > 0 ? (size_t)size : 1);
+    if( buffer && size > 0 && fread(buffer, 1, (size_t)size, file) != (size_t)size )
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    *length = size > 0 ? (size_t)size : 0;
+    return buffer;
+}
+
+static int write_output_file(const char* input_path, const struct lane_io* io)
+{
+    size_t length = strlen(input_path);
+    char* path = malloc(length + sizeof(".out"));
+    if( !path )
+    {
+        return 0;
+    }
+    memcpy(path, input_path, length);
+    memcpy(path + length, ".out", sizeof(".out"));
+    FILE* file = fopen(path, "wb");
+    free(path);
+    if( !file )
+    {
+        return 0;
+    }
+    fwrite(io->output, 1, io->output_length, file);
+    fclose(file);
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t instruction_limit = 0;
+    int i = 1;
+    if( i + 1 < argc && strcmp(argv[i], "-n") == 0 )
+    {
+        instruction_limit = strtoull(argv[i + 1], NULL, 0);
+        i += 2;
+    }
+
+    /* Images up to the "--" separator, inputs after it */
+    int images = 0;
+    for( ; i < argc && strcmp(argv[i], "--") != 0; ++i )
+    {
+        if( !read_image(argv[i]) )
+        {
+            printf("Failed to load image: %s\n", read_image_error());
+            exit(1);
+        }
+        ++images;
+    }
+    if( images == 0 || i == argc )
+    {
+        batch_usage();
+    }
+    char** inputs = argv + i + 1;
+    int input_count = argc - i - 1;
+
+    struct lockstep_batch* batch = aligned_alloc(32, sizeof(struct lockstep_batch));
+    if( !batch )
+    {
+        printf("Out of memory\n");
+        exit(1);
+    }
+
+    uint64_t dispatches = 0;
+    uint64_t lane_instructions = 0;
+    clock_t start = clock();
+
+    for( int first = 0; first < input_count; first += LOCKSTEP_LANES )
+    {
+        int lanes = input_count - first < LOCKSTEP_LANES ? input_count - first : LOCKSTEP_LANES;
+        uint8_t* buffers[LOCKSTEP_LANES] = { 0 };
+
+        if( !lockstep_init(batch, lanes, memory, PROGRAM_START) )
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        batch->instruction_limit = instruction_limit;
+        for( int lane = 0; lane < lanes; ++lane )
+        {
+            size_t length;
+            buffers[lane] = read_input_file(inputs[first + lane], &length);
+            if( !buffers[lane] )
+            {
+                printf("Failed to read input: %s\n", inputs[first + lane]);
+                exit(1);
+            }
+            batch->io[lane].input = buffers[lane];
+            batch->io[lane].input_length = length;
+        }
+
+        lockstep_run(batch);
+
+        for( int lane = 0; lane < lanes; ++lane )
+        {
+            const char* input = inputs[first + lane];
+            if( !write_output_file(input, &batch->io[lane]) )
+            {
+                printf("Failed to write output for: %s\n", input);
+            }
+            printf("%s: %s after %llu instructions, %zu bytes output\n",
+                   input, lockstep_status_name(batch->status[lane]),
+                   (unsigned long long)batch->retired[lane], batch->io[lane].output_length);
+            free(buffers[lane]);
+        }
+        dispatches += batch->dispatches;
+        lane_instructions += batch->lane_instructions;
+        lockstep_free(batch);
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%d inputs, %llu instructions in %llu dispatches (%.2f lanes/dispatch), %.1f MIPS\n",
+           input_count, (unsigned long long)lane_instructions, (unsigned long long)dispatches,
+           dispatches ? (double)lane_instructions / dispatches : 0.0,
+           seconds > 0 ? lane_instructions / seconds / 1e6 : 0.0);
+
+    free(batch);
+    return 0;
+}
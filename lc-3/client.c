@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+/* nix headers */
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/termios.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Utility functions */
+#include "./include/utilities/terminal_io.h"
+
+/*
+    lc3-client: local stand-in for a user of lc3-server.
+
+    Relays the terminal (or piped stdin) to one session and the session's output to stdout.
+    With -c it instead opens that many sessions and holds them idle, to load the server.
+*/
+
+static void client_usage(void)
+{
+    printf("lc3-client (-u socket-path | -p port) [-c idle-sessions]\n");
+    exit(2);
+}
+
+static int connect_session(const char* socket_path, int port)
+{
+    if( socket_path )
+    {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if( fd < 0 || strlen(socket_path) >= sizeof(address.sun_path) )
+        {
+            return -1;
+        }
+        strcpy(address.sun_path, socket_path);
+        if( connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0 )
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    if( connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0 )
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Copy stdin to the session and the session to stdout until the server closes it */
+static void relay(int fd)
+{
+    int interactive = isatty(STDIN_FILENO);
+    if( interactive )
+    {
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = STDIN_FILENO, .events = POLLIN }
+    };
+    int input_open = 1;
+    uint8_t buffer[4096];
+    for(;;)
+    {
+        if( poll(fds, input_open ? 2 : 1, -1) < 0 )
+        {
+            break;
+        }
+        if( fds[0].revents )
+        {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if( n <= 0 )
+            {
+                break;
+            }
+            fwrite(buffer, 1, (size_t)n, stdout);
+            fflush(stdout);
+        }
+        if( input_open && fds[1].revents )
+        {
+            ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if( n <= 0 )
+            {
+                /* The session closes once the VM asks for input beyond this point */
+                shutdown(fd, SHUT_WR);
+                input_open = 0;
+            }
+            else if( send(fd, buffer, (size_t)n, MSG_NOSIGNAL) < 0 )
+            {
+                break;
+            }
+        }
+    }
+
+    if( interactive )
+    {
+        restore_input_buffering();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* socket_path = NULL;
+    int port = 0;
+    long idle_sessions = 0;
+    for( int i = 1; i < argc; i += 2 )
+    {
+        if( i + 1 == argc )
+        {
+            client_usage();
+        }
+        if( strcmp(argv[i], "-u") == 0 )
+        {
+            socket_path = argv[i + 1];
+        }
+        else if( strcmp(argv[i], "-p") == 0 )
+        {
+            port = (int)strtol(argv[i + 1], NULL, 0);
+        }
+        else if( strcmp(argv[i], "-c") == 0 )
+        {
+            idle_sessions = strtol(argv[i + 1], NULL, 0);
+        }
+        else
+        {
+            client_usage();
+        }
+    }
+    if( !socket_path && !port )
+    {
+        client_usage();
+    }
+
+    if( idle_sessions > 0 )
+    {
+        for( long s = 0; s < idle_sessions; ++s )
+        {
+            if( connect_session(socket_path, port) < 0 )
+            {
+                printf("Failed to open session %ld: %s\n", s, strerror(errno));
+                exit(1);
+            }
+        }
+        printf("%ld sessions open\n", idle_sessions);
+        fflush(stdout);
+        /* Hold the sessions until interrupted */
+        for(;;)
+        {
+            pause();
+        }
+    }
+
+    int fd = connect_session(socket_path, port);
+    if( fd < 0 )
+    {
+        printf("Failed to connect: %s\n", strerror(errno));
+        exit(1);
+    }
+    relay(fd);
+    close(fd);
+    return 0;
+}
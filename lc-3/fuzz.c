@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Execution engines */
+#include "./include/engines/vm.h"
+#include "./include/engines/fuzz.h"
+
+/*
+    lc3-fuzz: in-process coverage guided fuzzing of LC-3 images.
+
+    Three ways to drive it:
+
+    libFuzzer (clang -fsanitize=fuzzer -DLC3_LIBFUZZER fuzz.c):
+        LC3_FUZZ_IMAGES=rogue.obj ./lc3-fuzz corpus/
+        Guest edges are exported as libFuzzer extra counters.
+
+    AFL++ (afl-clang-fast fuzz.c):
+        LC3_FUZZ_IMAGES=rogue.obj afl-fuzz -i corpus -o findings -- ./lc3-fuzz
+        Runs in persistent mode, guest edges are written to the AFL shared map. A map smaller
+        than the 64K counters of the VM (AFL++ sizes it to the instrumented target, or to
+        AFL_MAP_SIZE) takes the edges folded into it.
+
+    Standalone (make lc3-fuzz):
+        ./lc3-fuzz [-n max-instructions] [image-file] ... -- [input-file] ...
+        Replays the inputs and reports executions per second and edges covered. With LC3_PERF=1
+        the host performance counters of the replay are reported too, see performance_counters.h.
+
+    A bad opcode is a guest crash and aborts, as it does in main.c, so the fuzzer records it.
+    Delay loops are elided, LC3_DELAY_LOOPS=0 runs them (see include/engines/fuzz.h).
+    LC3_FUZZ_IMAGES is a colon separated list of images.
+*/
+
+static struct fuzz_target target;
+
+#if defined(LC3_LIBFUZZER)
+/* libFuzzer treats this section as additional 8-bit coverage counters */
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t coverage[VM_COVERAGE_SIZE];
+#elif defined(__AFL_HAVE_MANUAL_CONTROL)
+extern uint8_t* __afl_area_ptr;
+/* Size of the shared map in AFL++, whose map may be smaller or larger than VM_COVERAGE_SIZE. Absent in classic AFL */
+extern unsigned int __afl_map_size __attribute__((weak));
+#else
+static uint8_t coverage[VM_COVERAGE_SIZE];
+#endif
+
+#if defined(LC3_LIBFUZZER) || defined(__AFL_HAVE_MANUAL_CONTROL)
+/* Load the images named in LC3_FUZZ_IMAGES. Returns 1 on SUCCESS, 0 on FAILURE */
+static int load_images_from_environment(void)
+{
+    const char* images = getenv("LC3_FUZZ_IMAGES");
+    if( !images || !*images )
+    {
+        printf("LC3_FUZZ_IMAGES is not set\n");
+        return 0;
+    }
+    char* paths = strdup(images);
+    int loaded = 1;
+    for( char* path = strtok(paths, ":"); path && loaded; path = strtok(NULL, ":") )
+    {
+        if( !vm_load_image_file(&target.vm, path) )
+        {
+            printf("Failed to load image: %s\n", vm_load_error(&target.vm));
+            loaded = 0;
+        }
+    }
+    free(paths);
+    return loaded;
+}
+#endif
+
+/* fuzz_init() elides delay loops, LC3_DELAY_LOOPS=0 runs them */
+static void delay_loops_from_environment(void)
+{
+    const char* elide = getenv("LC3_DELAY_LOOPS");
+    if( elide && strcmp(elide, "0") == 0 )
+    {
+        target.vm.elide_delay_loops = 0;
+    }
+}
+
+static void run_input(const uint8_t* data, size_t size)
+{
+    if( fuzz_one(&target, data, size) == VM_STOP_BAD_OPCODE )
+    {
+        printf("Bad opcode, Aborting...\n");
+        abort();
+    }
+}
+
+#if defined(LC3_LIBFUZZER)
+
+int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    (void)argc;
+    (void)argv;
+    if( !load_images_from_environment() )
+    {
+        exit(1);
+    }
+    fuzz_init(&target, coverage, sizeof(coverage));
+    delay_loops_from_environment();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    run_input(data, size);
+    return 0;
+}
+
+#elif defined(__AFL_HAVE_MANUAL_CONTROL)
+
+/*
+    Bytes of the shared map guest edges may use: the map the runtime set up (classic AFL
+    always has 64KB), or less when AFL_MAP_SIZE asks for a smaller one
+*/
+static size_t afl_map_size(void)
+{
+    size_t size = &__afl_map_size ? __afl_map_size : (1 << 16);
+    const char* setting = getenv("AFL_MAP_SIZE");
+    if( setting )
+    {
+        size_t requested = strtoull(setting, NULL, 0);
+        if( requested && requested < size )
+        {
+            size = requested;
+        }
+    }
+    return size;
+}
+
+int main(void)
+{
+    if( !load_images_from_environment() )
+    {
+        exit(1);
+    }
+    fuzz_init(&target, __afl_area_ptr, afl_map_size());
+    delay_loops_from_environment();
+
+    static uint8_t input[1 << 16];
+    while( __AFL_LOOP(100000) )
+    {
+        size_t size = fread(input, 1, sizeof(input), stdin);
+        run_input(input, size);
+    }
+    return 0;
+}
+
+#else
+
+static void fuzz_usage(void)
+{
+    printf("lc3-fuzz [-n max-instructions] [image-file] ... -- [input-file] ...\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int i = 1;
+    if( i + 1 < argc && strcmp(argv[i], "-n") == 0 )
+    {
+        target.instruction_limit = strtoull(argv[i + 1], NULL, 0);
+        i += 2;
+    }
+    int images = 0;
+    for( ; i < argc && strcmp(argv[i], "--") != 0; ++i )
+    {
+        if( !vm_load_image_file(&target.vm, argv[i]) )
+        {
+            printf("Failed to load image: %s\n", vm_load_error(&target.vm));
+            exit(1);
+        }
+        ++images;
+    }
+    if( images == 0 || i == argc )
+    {
+        fuzz_usage();
+    }
+    fuzz_init(&target, coverage, sizeof(coverage));
+    delay_loops_from_environment();
+
+    /* Host performance counters per phase and guest subroutine */
+    static struct performance_counters perf;
+    const char* perf_setting = getenv("LC3_PERF");
+    if( perf_setting && strcmp(perf_setting, "0") != 0 )
+    {
+        perf_counters_open(&perf, VM_PROGRAM_START);
+        target.vm.perf = &perf;
+    }
+
+    static uint8_t input[1 << 16];
+    clock_t start = clock();
+    for( ++i; i < argc; ++i )
+    {
+        FILE* file = fopen(argv[i], "rb");
+        if( !file )
+        {
+            printf("Failed to read input: %s\n", argv[i]);
+            exit(1);
+        }
+        size_t size = fread(input, 1, sizeof(input), file);
+        fclose(file);
+        run_input(input, size);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    int edges = 0;
+    for( int e = 0; e < VM_COVERAGE_SIZE; ++e )
+    {
+        edges += coverage[e] != 0;
+    }
+    printf("%llu executions, %llu instructions (%llu in delay loops), %d edges, %.0f execs/s\n",
+           (unsigned long long)target.executions, (unsigned long long)target.vm.retired,
+           (unsigned long long)target.vm.elided, edges,
+           seconds > 0 ? target.executions / seconds : 0.0);
+    if( target.vm.perf )
+    {
+        perf_counters_report(&perf, "vm", target.vm.retired);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef LC3_FUZZ_H
+#define LC3_FUZZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "./vm.h"
+
+/*
+    In-process fuzzing target.
+
+    The fuzz input is the keyboard: GETC, IN and KBSR/KBDR consume it byte by byte and the
+    run ends when the guest asks for more input than there is, halts, hits a bad opcode or
+    runs out of its instruction budget. Edges between BR/JMP/JSR and their targets are
+    counted in the coverage map of the VM.
+
+    Between iterations only the registers and the memory pages the guest wrote are restored,
+    so an iteration costs in proportion to what the guest touched rather than to 128KB of memory.
+
+    Delay loops are elided (see delay_loops.h): a guest counting down a million iterations
+    per key otherwise spends the budget there. The target may turn it off after fuzz_init().
+*/
+
+/* Default instruction budget for one input: keeps hangs cheap */
+#define FUZZ_DEFAULT_LIMIT 1000000
+
+struct fuzz_target
+{
+    struct lc3_vm vm;
+    /* Memory as loaded, restored page by page from the dirty bitmap */
+    uint16_t pristine[VM_MEMORY_WORDS];
+
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+
+    uint64_t instruction_limit;
+    uint64_t executions;
+};
+
+/* Bytes written by the guest are discarded: only coverage is of interest */
+static void fuzz_output(void* context, const uint8_t* bytes, size_t length)
+{
+    (void)context;
+    (void)bytes;
+    (void)length;
+}
+
+static int fuzz_input(void* context)
+{
+    struct fuzz_target* target = context;
+    if( target->position == target->size )
+    {
+        return -1;
+    }
+    return target->data[target->position++];
+}
+
+/*
+    Count edges in the `size` byte map at `coverage`. A map smaller than VM_COVERAGE_SIZE
+    takes the edges folded into its largest power of two, a larger one only its start
+*/
+void fuzz_set_coverage(struct fuzz_target* target, uint8_t* coverage, size_t size)
+{
+    size_t used = 1;
+    while( used * 2 <= size && used * 2 <= VM_COVERAGE_SIZE )
+    {
+        used *= 2;
+    }
+    target->vm.coverage = coverage;
+    target->vm.coverage_mask = (uint16_t)(used - 1);
+}
+
+/* Prepare the target once the images are loaded into target->vm.memory */
+void fuzz_init(struct fuzz_target* target, uint8_t* coverage, size_t coverage_size)
+{
+    memcpy(target->pristine, target->vm.memory, sizeof(target->pristine));
+    vm_clear_dirty(&target->vm);
+    vm_reset_registers(&target->vm);
+    target->vm.input = fuzz_input;
+    target->vm.output = fuzz_output;
+    target->vm.context = target;
+    /* A guest polling an empty keyboard would only burn the budget */
+    target->vm.stop_on_idle_poll = 1;
+    fuzz_set_coverage(target, coverage, coverage_size);
+    /* Nothing is paced while fuzzing: delay loops only burn the budget */
+    target->vm.elide_delay_loops = 1;
+    if( !target->instruction_limit )
+    {
+        target->instruction_limit = FUZZ_DEFAULT_LIMIT;
+    }
+}
+
+/* Restore the pages written since the last reset and the power-on registers */
+void fuzz_reset(struct fuzz_target* target)
+{
+    struct lc3_vm* vm = &target->vm;
+    for( int word = 0; word < VM_PAGES / 64; ++word )
+    {
+        for( uint64_t bits = vm->dirty[word]; bits; bits &= bits - 1 )
+        {
+            int page = word * 64 + __builtin_ctzll(bits);
+            memcpy(vm->memory + page * VM_PAGE_WORDS, target->pristine + page * VM_PAGE_WORDS,
+                   VM_PAGE_WORDS * sizeof(uint16_t));
+        }
+    }
+    vm_clear_dirty(vm);
+    vm_reset_registers(vm);
+}
+
+/* Run one input. Returns the VM_STOP_* reason of the run */
+int fuzz_one(struct fuzz_target* target, const uint8_t* data, size_t size)
+{
+    target->data = data;
+    target->size = size;
+    target->position = 0;
+    int stop = vm_run(&target->vm, target->instruction_limit);
+    fuzz_reset(target);
+    ++target->executions;
+    return stop;
+}
+
+#endif //LC3_FUZZ_H
@@ -0,0 +1,729 @@
+#ifndef LC3_LOCKSTEP_H
+#define LC3_LOCKSTEP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../register_numbers.h"
+#include "../opcodes.h"
+#include "../condition_flags.h"
+#include "../trap_codes.h"
+#include "../memory_mapped_registers.h"
+#include "../utilities/sign_extension.h"
+
+/*
+    Lockstep batch interpreter.
+
+    Runs the same image over up to LOCKSTEP_LANES independent input streams at once.
+    The register files are kept in SoA layout (registers[register][lane]) so that one
+    256-bit vector holds the same register for all 16 lanes.
+
+    Every step selects a group of lanes that share a PC (and hence an instruction),
+    fetches and decodes that instruction once, then executes it for the whole group.
+    Register-only instructions (ADD, AND, NOT, BR, JMP, JSR, LEA), the PC and the retired
+    counts are updated with vector operations blended under a lane mask. PC relative loads
+    from memory no lane has written read the image once for the group. Other memory
+    accesses and traps go through each lane's own memory and I/O and are executed per lane.
+
+    Lanes diverge on BR/JMP. The group is always the set of lanes at the minimum PC,
+    so lanes that fell behind run alone until they catch up with the others and are
+    re-grouped automatically once their PCs converge again. (Taking the largest group
+    instead re-converges worse: 2.8 lanes per dispatch against 7.6 on 2048.) A search also
+    yields the lowest PC outside the group, and while control flow keeps the group together
+    and below it the next group is known without searching again.
+
+    The vectors are GCC vector extensions: lockstep_run() is compiled for AVX2 and for the
+    baseline target, and picks the AVX2 build when the CPU has it.
+*/
+
+#define LOCKSTEP_LANES 16
+#define LOCKSTEP_MEMORY_WORDS (UINT16_MAX + 1)
+/* Writes are tracked per lane in pages of 256 words */
+#define LOCKSTEP_PAGE_SHIFT 8
+#define LOCKSTEP_PAGES (LOCKSTEP_MEMORY_WORDS >> LOCKSTEP_PAGE_SHIFT)
+/* and per batch in chunks of 16 words, with the lanes that wrote each chunk */
+#define LOCKSTEP_CHUNK_SHIFT 4
+#define LOCKSTEP_CHUNKS (LOCKSTEP_MEMORY_WORDS >> LOCKSTEP_CHUNK_SHIFT)
+/* Retired counts are kept in 16 bits per lane between flushes */
+#define LOCKSTEP_COUNT_WINDOW UINT16_MAX
+
+/* The same register of every lane */
+typedef uint16_t lockstep_vector __attribute__((vector_size(32), may_alias));
+typedef uint64_t lockstep_words __attribute__((vector_size(32), may_alias));
+/* Half of the lanes, for reductions: shuffles within 16 bytes are cheap without AVX2 too */
+typedef int16_t lockstep_half __attribute__((vector_size(16), may_alias));
+
+enum
+{
+    LANE_RUNNING = 0,
+    LANE_HALTED,            /* TRAP HALT */
+    LANE_BAD_OPCODE,        /* RTI/RES */
+    LANE_INPUT_EXHAUSTED,   /* GETC/IN/KBSR with nothing left in the input stream */
+    LANE_LIMIT              /* instruction limit reached */
+};
+
+struct lane_io
+{
+    const uint8_t* input;
+    size_t input_length;
+    size_t input_position;
+
+    uint8_t* output;
+    size_t output_length;
+    size_t output_capacity;
+};
+
+struct lockstep_batch
+{
+    /* SoA register file: registers[R_PC][lane] is the program counter of lane */
+    uint16_t registers[R_COUNT][LOCKSTEP_LANES] __attribute__((aligned(32)));
+    /* Each lane has its own 64K word memory */
+    uint16_t* memory[LOCKSTEP_LANES];
+    /* Bit per page written, cleared by the user (lc3-validate hashes only the pages written) */
+    uint64_t dirty[LOCKSTEP_LANES][LOCKSTEP_PAGES / 64];
+    /* Lanes that wrote each chunk: a chunk no lane in a group wrote still holds the image for all of them */
+    uint16_t written[LOCKSTEP_CHUNKS];
+    /* Lanes with KBSR set, which the next read of any other address clears */
+    uint32_t keyboard_ready;
+    struct lane_io io[LOCKSTEP_LANES];
+    int status[LOCKSTEP_LANES];
+    uint64_t retired[LOCKSTEP_LANES];
+    /* Instructions retired since the last lockstep_count(), and the dispatches until the next one */
+    uint16_t counted[LOCKSTEP_LANES] __attribute__((aligned(32)));
+    uint32_t count_dispatches;
+    uint32_t count_window;
+
+    /* Bitmask of lanes still executing */
+    uint32_t running;
+    /* Maximum number of instructions per lane, 0 for no limit */
+    uint64_t instruction_limit;
+
+    /* Group dispatches and lane instructions retired: retired / dispatches is the SIMD utilisation */
+    uint64_t dispatches;
+    uint64_t lane_instructions;
+};
+
+/* Name of a lane status for reporting */
+const char* lockstep_status_name(int status)
+{
+    switch(status)
+    {
+        case LANE_RUNNING: return "running";
+        case LANE_HALTED: return "halted";
+        case LANE_BAD_OPCODE: return "bad opcode";
+        case LANE_INPUT_EXHAUSTED: return "input exhausted";
+        case LANE_LIMIT: return "instruction limit";
+    }
+    return "unknown";
+}
+
+void lockstep_free(struct lockstep_batch* batch)
+{
+    for( int lane = 0; lane < LOCKSTEP_LANES; ++lane )
+    {
+        free(batch->memory[lane]);
+        free(batch->io[lane].output);
+        batch->memory[lane] = NULL;
+        batch->io[lane].output = NULL;
+    }
+}
+
+/*
+    Initialise a batch with `lanes` lanes, each starting from a copy of `image` (LOCKSTEP_MEMORY_WORDS words).
+    Returns 1 on SUCCESS, 0 on FAILURE.
+*/
+int lockstep_init(struct lockstep_batch* batch, int lanes, const uint16_t* image, uint16_t start)
+{
+    memset(batch, 0, sizeof(*batch));
+    for( int lane = 0; lane < lanes; ++lane )
+    {
+        batch->memory[lane] = malloc(LOCKSTEP_MEMORY_WORDS * sizeof(uint16_t));
+        if( !batch->memory[lane] )
+        {
+            lockstep_free(batch);
+            return 0;
+        }
+        memcpy(batch->memory[lane], image, LOCKSTEP_MEMORY_WORDS * sizeof(uint16_t));
+        batch->registers[R_PC][lane] = start;
+        batch->registers[R_COND][lane] = FL_ZER;
+        batch->running |= 1u << lane;
+        if( image[MMR_KBSR] )
+        {
+            batch->keyboard_ready |= 1u << lane;
+        }
+    }
+    /* Count after the first dispatch, which sets the window from instruction_limit */
+    batch->count_window = 1;
+    return 1;
+}
+
+/* Stop a lane and remove it from the running mask */
+static inline void lockstep_stop(struct lockstep_batch* batch, int lane, int status)
+{
+    batch->status[lane] = status;
+    batch->running &= ~(1u << lane);
+}
+
+static void lockstep_putc(struct lane_io* io, uint8_t c)
+{
+    if( io->output_length == io->output_capacity )
+    {
+        size_t capacity = io->output_capacity ? io->output_capacity * 2 : 256;
+        uint8_t* output = realloc(io->output, capacity);
+        if( !output )
+        {
+            /* Drop output rather than kill the whole batch */
+            return;
+        }
+        io->output = output;
+        io->output_capacity = capacity;
+    }
+    io->output[io->output_length++] = c;
+}
+
+static void lockstep_puts(struct lane_io* io, const char* s)
+{
+    while(*s)
+    {
+        lockstep_putc(io, (uint8_t)*s++);
+    }
+}
+
+static inline void lockstep_write(struct lockstep_batch* batch, int lane, uint16_t address, uint16_t value)
+{
+    uint16_t page = address >> LOCKSTEP_PAGE_SHIFT;
+    batch->memory[lane][address] = value;
+    batch->dirty[lane][page >> 6] |= 1ull << (page & 63);
+    batch->written[address >> LOCKSTEP_CHUNK_SHIFT] |= (uint16_t)(1u << lane);
+    if( address == MMR_KBSR )
+    {
+        batch->keyboard_ready = value ? batch->keyboard_ready | 1u << lane : batch->keyboard_ready & ~(1u << lane);
+    }
+}
+
+/* Next input byte of a lane, or -1 when the stream is exhausted */
+static inline int lockstep_getc(struct lane_io* io)
+{
+    if( io->input_position == io->input_length )
+    {
+        return -1;
+    }
+    return io->input[io->input_position++];
+}
+
+/*
+    Per lane memory read with the same MMIO semantics as memory_read():
+    reading KBSR polls the keyboard (the lane's input stream), any other read clears KBSR.
+*/
+static inline uint16_t lockstep_read(struct lockstep_batch* batch, int lane, uint16_t address)
+{
+    uint16_t* memory = batch->memory[lane];
+    if( address == MMR_KBSR )
+    {
+        int c = lockstep_getc(&batch->io[lane]);
+        if( c < 0 )
+        {
+            /* Polling with no input left would spin forever */
+            lockstep_stop(batch, lane, LANE_INPUT_EXHAUSTED);
+            return 0;
+        }
+        lockstep_write(batch, lane, MMR_KBSR, 1 << 15);
+        lockstep_write(batch, lane, MMR_KBDR, (uint16_t)c);
+    }
+    else if( batch->keyboard_ready & (1u << lane) )
+    {
+        lockstep_write(batch, lane, MMR_KBSR, 0);
+    }
+    return memory[address];
+}
+
+/*
+    Vector helpers.
+    A lane mask is a bitmask with bit `lane` set for every lane taking part in the step;
+    its vector form has every bit of the selected lanes set.
+    The helpers are always inlined, so no vector crosses a call whatever the target: the
+    ABI note GCC gives for 32 byte vectors without AVX does not apply. It is only issued at
+    the end of the translation unit, where no pragma here reaches, so the files including
+    us are built with -Wno-psabi.
+*/
+static const lockstep_vector lockstep_lane_bits = {
+    0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+    0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000 };
+
+/*
+    `value` in every lane. A macro: a vector built in a helper compiled for the baseline
+    target is split into 128 bit halves before it is inlined, and the AVX2 build would
+    then assemble it a word at a time instead of broadcasting it.
+*/
+#define LOCKSTEP_SPLAT(value) ((lockstep_vector)((lockstep_vector){ 0 } + (uint16_t)(value)))
+
+__attribute__((always_inline))
+static inline lockstep_vector lockstep_mask_vector(uint32_t mask)
+{
+    return (lockstep_vector)((lockstep_lane_bits & LOCKSTEP_SPLAT((uint16_t)mask)) != 0);
+}
+
+__attribute__((always_inline))
+static inline lockstep_vector* lockstep_row(struct lockstep_batch* batch, int r)
+{
+    return (lockstep_vector*)batch->registers[r];
+}
+
+/* Write `value` into the lanes of `row` selected by `mask` */
+__attribute__((always_inline))
+static inline void lockstep_store(lockstep_vector* row, lockstep_vector value, lockstep_vector mask)
+{
+    *row = (*row & ~mask) | (value & mask);
+}
+
+/* Condition flags of `value` per lane: FL_ZER, FL_NEG or FL_POS */
+__attribute__((always_inline))
+static inline lockstep_vector lockstep_flags(lockstep_vector value)
+{
+    lockstep_vector zero = (lockstep_vector)(value == 0);
+    lockstep_vector negative = (lockstep_vector)(value >> 15 != 0);
+    lockstep_vector flags = (LOCKSTEP_SPLAT(FL_NEG) & negative) | (LOCKSTEP_SPLAT(FL_POS) & ~negative);
+    return (LOCKSTEP_SPLAT(FL_ZER) & zero) | (flags & ~zero);
+}
+
+/* Set in every lane */
+__attribute__((always_inline))
+static inline int lockstep_all(lockstep_vector mask)
+{
+    lockstep_words words = (lockstep_words)mask;
+    return (words[0] & words[1] & words[2] & words[3]) == UINT64_MAX;
+}
+
+/* Set in any lane */
+__attribute__((always_inline))
+static inline int lockstep_any(lockstep_vector mask)
+{
+    lockstep_words words = (lockstep_words)mask;
+    return (words[0] | words[1] | words[2] | words[3]) != 0;
+}
+
+/* Write `value` to register r and update R_COND for the lanes in mask */
+__attribute__((always_inline))
+static inline void lockstep_writeback(struct lockstep_batch* batch, uint16_t r, lockstep_vector value, uint32_t mask)
+{
+    lockstep_vector m = lockstep_mask_vector(mask);
+    lockstep_store(lockstep_row(batch, r), value, m);
+    lockstep_store(lockstep_row(batch, R_COND), lockstep_flags(value), m);
+}
+
+/*
+    Add the retired counts kept in 16 bits to retired[] and stop the lanes that reached the
+    instruction limit. The next count is due before the lane closest to the limit can pass it.
+*/
+static void lockstep_count(struct lockstep_batch* batch)
+{
+    uint64_t window = LOCKSTEP_COUNT_WINDOW;
+    for( int lane = 0; lane < LOCKSTEP_LANES; ++lane )
+    {
+        batch->retired[lane] += batch->counted[lane];
+        batch->counted[lane] = 0;
+        if( batch->instruction_limit && (batch->running & (1u << lane)) )
+        {
+            if( batch->retired[lane] >= batch->instruction_limit )
+            {
+                lockstep_stop(batch, lane, LANE_LIMIT);
+            }
+            else if( batch->instruction_limit - batch->retired[lane] < window )
+            {
+                window = batch->instruction_limit - batch->retired[lane];
+            }
+        }
+    }
+    batch->count_dispatches = 0;
+    batch->count_window = (uint32_t)window;
+}
+
+/* Horizontal minimum of PCs biased by 0x8000: halve the distance between the lanes compared each time */
+__attribute__((always_inline))
+static inline uint16_t lockstep_minimum(lockstep_vector biased)
+{
+    const lockstep_half by4 = { 4, 5, 6, 7, 0, 1, 2, 3 };
+    const lockstep_half by2 = { 2, 3, 0, 1, 6, 7, 4, 5 };
+    const lockstep_half by1 = { 1, 0, 3, 2, 5, 4, 7, 6 };
+    lockstep_half v = ((lockstep_half*)&biased)[0];
+    lockstep_half w = ((lockstep_half*)&biased)[1];
+    v = (v & (v < w)) | (w & (v >= w));
+    w = __builtin_shuffle(v, by4);
+    v = (v & (v < w)) | (w & (v >= w));
+    w = __builtin_shuffle(v, by2);
+    v = (v & (v < w)) | (w & (v >= w));
+    w = __builtin_shuffle(v, by1);
+    v = (v & (v < w)) | (w & (v >= w));
+    return (uint16_t)v[0] ^ 0x8000;
+}
+
+/*
+    Pick the next group: all running lanes at the minimum PC.
+    Stores the shared PC in *pc and the lowest PC of the lanes outside the group in *ceiling
+    (0xFFFF when there are none), and returns the lane mask (0 when nothing is running).
+    Until the group reaches the ceiling it is still the group at the minimum PC, so it can
+    keep stepping without another search.
+*/
+__attribute__((always_inline))
+static inline uint32_t lockstep_group(struct lockstep_batch* batch, uint16_t* pc, uint16_t* ceiling)
+{
+    uint32_t running = batch->running;
+    if( !running )
+    {
+        return 0;
+    }
+    /* Park stopped lanes at 0xFFFF so they never win the minimum */
+    lockstep_vector pcs = *lockstep_row(batch, R_PC);
+    lockstep_vector active = lockstep_mask_vector(running);
+    /* Flip the sign bits: the signed minimum is then the unsigned one, which SSE2 has */
+    lockstep_vector biased = (pcs | ~active) ^ LOCKSTEP_SPLAT(0x8000);
+    uint16_t minimum = lockstep_minimum(biased);
+    lockstep_vector group = (lockstep_vector)(pcs == LOCKSTEP_SPLAT(minimum)) & active;
+    *ceiling = lockstep_minimum((biased & ~group) | (group & LOCKSTEP_SPLAT(0x7FFF)));
+
+    /* Lane bits of the lanes at the minimum, ORed together the same way */
+    const lockstep_half by4 = { 4, 5, 6, 7, 0, 1, 2, 3 };
+    const lockstep_half by2 = { 2, 3, 0, 1, 6, 7, 4, 5 };
+    const lockstep_half by1 = { 1, 0, 3, 2, 5, 4, 7, 6 };
+    lockstep_vector bits = lockstep_lane_bits & group;
+    lockstep_half v = ((lockstep_half*)&bits)[0] | ((lockstep_half*)&bits)[1];
+    v |= __builtin_shuffle(v, by4);
+    v |= __builtin_shuffle(v, by2);
+    v |= __builtin_shuffle(v, by1);
+    *pc = minimum;
+    return (uint16_t)v[0];
+}
+
+/* Execute a trap for a single lane */
+static void lockstep_trap(struct lockstep_batch* batch, int lane, uint16_t vector)
+{
+    uint16_t* memory = batch->memory[lane];
+    struct lane_io* io = &batch->io[lane];
+    uint16_t* r = &batch->registers[0][lane];
+#define LANE_REGISTER(n) r[(n) * LOCKSTEP_LANES]
+
+    LANE_REGISTER(R_R7) = LANE_REGISTER(R_PC);
+    switch(vector)
+    {
+        case TRAP_GETC:
+            {
+                int c = lockstep_getc(io);
+                if( c < 0 )
+                {
+                    lockstep_stop(batch, lane, LANE_INPUT_EXHAUSTED);
+                    break;
+                }
+                LANE_REGISTER(R_R0) = (uint16_t)c;
+                LANE_REGISTER(R_COND) = c == 0 ? FL_ZER : FL_POS;
+            }
+            break;
+        case TRAP_OUT:
+            lockstep_putc(io, (uint8_t)LANE_REGISTER(R_R0));
+            break;
+        case TRAP_PUTS:
+            {
+                uint16_t address = LANE_REGISTER(R_R0);
+                while(memory[address])
+                {
+                    lockstep_putc(io, (uint8_t)memory[address++]);
+                }
+            }
+            break;
+        case TRAP_IN:
+            {
+                lockstep_puts(io, "Enter a character: ");
+                int c = lockstep_getc(io);
+                if( c < 0 )
+                {
+                    lockstep_stop(batch, lane, LANE_INPUT_EXHAUSTED);
+                    break;
+                }
+                lockstep_putc(io, (uint8_t)c);
+                LANE_REGISTER(R_R0) = (uint16_t)c;
+                LANE_REGISTER(R_COND) = c == 0 ? FL_ZER : FL_POS;
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                uint16_t address = LANE_REGISTER(R_R0);
+                while(memory[address])
+                {
+                    uint16_t word = memory[address++];
+                    lockstep_putc(io, (uint8_t)(word & 0xFF));
+                    if( word >> 8 )
+                    {
+                        lockstep_putc(io, (uint8_t)(word >> 8));
+                    }
+                }
+            }
+            break;
+        case TRAP_HALT:
+            lockstep_puts(io, "HALT\n");
+            lockstep_stop(batch, lane, LANE_HALTED);
+            break;
+    }
+#undef LANE_REGISTER
+}
+
+/*
+    Execute one instruction for every lane in `mask`. All lanes in the group share `pc`.
+    Lanes whose memory holds a different instruction at `pc` (self modifying code) are
+    left out of the group and picked up by a later step.
+    Returns the PC the whole group goes to next, -1 when the lanes went different ways or
+    some of them stopped or were left out.
+*/
+__attribute__((always_inline))
+static inline int lockstep_step(struct lockstep_batch* batch, uint32_t mask, uint16_t pc)
+{
+    uint32_t group_mask = mask;
+    if( pc == MMR_KBSR )
+    {
+        /* Fetching KBSR polls the keyboard of every lane: the lanes may fetch different words */
+        for( uint32_t m = mask; m; m &= m - 1 )
+        {
+            lockstep_read(batch, __builtin_ctz(m), pc);
+        }
+        mask &= batch->running;
+        if( !mask )
+        {
+            return -1;
+        }
+    }
+    int leader = __builtin_ctz(mask);
+    uint16_t instruction = batch->memory[leader][pc];
+    /* Lanes can only disagree about an instruction one of them has written over */
+    if( batch->written[pc >> LOCKSTEP_CHUNK_SHIFT] & mask )
+    {
+        for( uint32_t rest = mask & (mask - 1); rest; rest &= rest - 1 )
+        {
+            int lane = __builtin_ctz(rest);
+            if( batch->memory[lane][pc] != instruction )
+            {
+                mask &= ~(1u << lane);
+            }
+        }
+    }
+
+    /* Fetch: PC is incremented before execution, as in main(). Retired counts go up by one */
+    uint16_t next_pc = pc + 1;
+    lockstep_vector group = lockstep_mask_vector(mask);
+    lockstep_store(lockstep_row(batch, R_PC), LOCKSTEP_SPLAT(next_pc), group);
+    *(lockstep_vector*)batch->counted -= group;
+
+    ++batch->dispatches;
+    batch->lane_instructions += __builtin_popcount(mask);
+
+    /* Where the group goes next when every lane goes to the same place, -1 when they may not */
+    int next = next_pc;
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
+
+    switch(instruction >> 12)
+    {
+        case OP_ADD:
+        case OP_AND:
+            {
+                lockstep_vector x = *lockstep_row(batch, r1);
+                lockstep_vector y = (instruction >> 5) & 0x1
+                    ? LOCKSTEP_SPLAT(sign_extension(instruction & 0x1F, 5))
+                    : *lockstep_row(batch, instruction & 0x7);
+                lockstep_writeback(batch, r0, (instruction >> 12) == OP_ADD ? x + y : x & y, mask);
+            }
+            break;
+
+        case OP_NOT:
+            lockstep_writeback(batch, r0, ~*lockstep_row(batch, r1), mask);
+            break;
+
+        case OP_BR:
+            {
+                uint16_t pc_offset_9 = sign_extension(instruction & 0x1FF, 9);
+                uint16_t condition_flags = (instruction >> 9) & 0x7;
+                lockstep_vector taken = (lockstep_vector)((*lockstep_row(batch, R_COND) & LOCKSTEP_SPLAT(condition_flags)) != 0) & group;
+                lockstep_store(lockstep_row(batch, R_PC), LOCKSTEP_SPLAT(next_pc + pc_offset_9), taken);
+                if( lockstep_all(taken | ~group) )
+                {
+                    next = (uint16_t)(next_pc + pc_offset_9);
+                }
+                else if( lockstep_any(taken) )
+                {
+                    next = -1;
+                }
+            }
+            break;
+
+        case OP_JMP:
+        case OP_JSR:
+            {
+                /* Read the base register before R7 is overwritten (JSRR R7) */
+                lockstep_vector base = *lockstep_row(batch, r1);
+                if( (instruction >> 12) == OP_JSR )
+                {
+                    lockstep_store(lockstep_row(batch, R_R7), LOCKSTEP_SPLAT(next_pc), group);
+                    if( (instruction >> 11) & 1 )
+                    {
+                        base = LOCKSTEP_SPLAT(next_pc + sign_extension(instruction & 0x7FF, 11));
+                    }
+                }
+                lockstep_store(lockstep_row(batch, R_PC), base, group);
+                next = lockstep_all((lockstep_vector)(base == LOCKSTEP_SPLAT(base[leader])) | ~group) ? base[leader] : -1;
+            }
+            break;
+
+        case OP_LEA:
+            lockstep_writeback(batch, r0, LOCKSTEP_SPLAT(next_pc + sign_extension(instruction & 0x1FF, 9)), mask);
+            break;
+
+        case OP_LD:
+        case OP_LDI:
+            {
+                uint16_t address = next_pc + sign_extension(instruction & 0x1FF, 9);
+                uint16_t result[LOCKSTEP_LANES] __attribute__((aligned(32)));
+                if( (instruction >> 12) == OP_LD && address != MMR_KBSR && !(batch->written[address >> LOCKSTEP_CHUNK_SHIFT] & mask) )
+                {
+                    /* Nobody wrote it: the image word, read once */
+                    uint16_t value = batch->memory[leader][address];
+                    for( uint32_t m = mask & batch->keyboard_ready; m; m &= m - 1 )
+                    {
+                        lockstep_write(batch, __builtin_ctz(m), MMR_KBSR, 0);
+                    }
+                    lockstep_writeback(batch, r0, LOCKSTEP_SPLAT(value), mask);
+                    break;
+                }
+                for( uint32_t m = mask; m; m &= m - 1 )
+                {
+                    int lane = __builtin_ctz(m);
+                    uint16_t value = lockstep_read(batch, lane, address);
+                    if( (instruction >> 12) == OP_LDI )
+                    {
+                        value = lockstep_read(batch, lane, value);
+                    }
+                    result[lane] = value;
+                }
+                lockstep_writeback(batch, r0, *(lockstep_vector*)result, mask & batch->running);
+            }
+            break;
+
+        case OP_LDR:
+            {
+                uint16_t offset = sign_extension(instruction & 0x3F, 6);
+                uint16_t result[LOCKSTEP_LANES] __attribute__((aligned(32)));
+                for( uint32_t m = mask; m; m &= m - 1 )
+                {
+                    int lane = __builtin_ctz(m);
+                    result[lane] = lockstep_read(batch, lane, batch->registers[r1][lane] + offset);
+                }
+                lockstep_writeback(batch, r0, *(lockstep_vector*)result, mask & batch->running);
+            }
+            break;
+
+        case OP_ST:
+            {
+                uint16_t address = next_pc + sign_extension(instruction & 0x1FF, 9);
+                for( uint32_t m = mask; m; m &= m - 1 )
+                {
+                    int lane = __builtin_ctz(m);
+                    lockstep_write(batch, lane, address, batch->registers[r0][lane]);
+                }
+            }
+            break;
+
+        case OP_STI:
+            {
+                uint16_t address = next_pc + sign_extension(instruction & 0x1FF, 9);
+                for( uint32_t m = mask; m; m &= m - 1 )
+                {
+                    int lane = __builtin_ctz(m);
+                    uint16_t target = lockstep_read(batch, lane, address);
+                    if( batch->running & (1u << lane) )
+                    {
+                        lockstep_write(batch, lane, target, batch->registers[r0][lane]);
+                    }
+                }
+            }
+            break;
+
+        case OP_STR:
+            {
+                uint16_t offset = sign_extension(instruction & 0x3F, 6);
+                for( uint32_t m = mask; m; m &= m - 1 )
+                {
+                    int lane = __builtin_ctz(m);
+                    lockstep_write(batch, lane, batch->registers[r1][lane] + offset, batch->registers[r0][lane]);
+                }
+            }
+            break;
+
+        case OP_TRAP:
+            for( uint32_t m = mask; m; m &= m - 1 )
+            {
+                lockstep_trap(batch, __builtin_ctz(m), instruction & 0xFF);
+            }
+            break;
+
+        case OP_RES:
+            /* Unused: fall through */
+        case OP_RTI:
+            /* Unused: fall through */
+        default:
+            for( uint32_t m = mask; m; m &= m - 1 )
+            {
+                lockstep_stop(batch, __builtin_ctz(m), LANE_BAD_OPCODE);
+            }
+            break;
+    }
+
+    if( ++batch->count_dispatches == batch->count_window )
+    {
+        lockstep_count(batch);
+    }
+    /* Lanes of the group that stopped or were left behind make the next group a search */
+    return (mask & batch->running) == group_mask ? next : -1;
+}
+
+/* Run until every lane has stopped */
+__attribute__((always_inline))
+static inline void lockstep_run_lanes(struct lockstep_batch* batch)
+{
+    uint16_t pc = 0;
+    uint16_t ceiling = 0;
+    uint32_t mask = 0;
+    int next = -1;
+    for(;;)
+    {
+        if( next >= 0 && next < ceiling )
+        {
+            pc = (uint16_t)next;
+        }
+        else if( !(mask = lockstep_group(batch, &pc, &ceiling)) )
+        {
+            break;
+        }
+        next = lockstep_step(batch, mask, pc);
+    }
+    lockstep_count(batch);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void lockstep_run_avx2(struct lockstep_batch* batch)
+{
+    lockstep_run_lanes(batch);
+}
+#endif
+
+void lockstep_run(struct lockstep_batch* batch)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if( __builtin_cpu_supports("avx2") )
+    {
+        lockstep_run_avx2(batch);
+        return;
+    }
+#endif
+    lockstep_run_lanes(batch);
+}
+
+#endif //LC3_LOCKSTEP_H
@@ -0,0 +1,108 @@
+#ifndef LC3_SESSION_H
+#define LC3_SESSION_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "./vm.h"
+
+/*
+    One interactive VM served over a socket.
+
+    The I/O thread is the only producer of the input ring and a worker running the VM the only
+    consumer, so the ring needs no lock. Everything else in the session is protected by `lock`.
+
+    A session moves between three scheduling states:
+        SESSION_PARKED:  waiting for input (GETC, IN or an empty KBSR poll), not on the run queue
+        SESSION_QUEUED:  runnable, on the run queue
+        SESSION_RUNNING: owned by a worker
+*/
+
+#define SESSION_INPUT_SIZE 4096 /* power of two */
+#define SESSION_OUTPUT_SIZE 16384
+
+enum
+{
+    SESSION_PARKED = 0,
+    SESSION_QUEUED,
+    SESSION_RUNNING
+};
+
+struct input_ring
+{
+    uint8_t data[SESSION_INPUT_SIZE];
+    _Atomic uint32_t head; /* written by the consumer */
+    _Atomic uint32_t tail; /* written by the producer */
+};
+
+struct session
+{
+    struct lc3_vm vm;
+    int fd;
+
+    pthread_mutex_t lock;
+    int state;
+    /* The peer shut down its sending side: close once the VM has consumed the remaining input */
+    int input_closed;
+    /* The peer hung up or the VM stopped: free once no worker owns the session */
+    int closing;
+    /* Handed to the I/O thread to be freed */
+    int retired;
+
+    struct input_ring input;
+
+    /* Output the socket would not take yet, flushed on EPOLLOUT */
+    uint8_t output[SESSION_OUTPUT_SIZE];
+    size_t output_length;
+
+    /* Run queue link */
+    struct session* next;
+};
+
+/* Free space of the ring, called by the producer */
+static inline uint32_t input_ring_space(struct input_ring* ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return SESSION_INPUT_SIZE - (tail - head);
+}
+
+/* Append bytes, called by the producer. Returns the number of bytes stored */
+static inline size_t input_ring_push(struct input_ring* ring, const uint8_t* bytes, size_t length)
+{
+    uint32_t space = input_ring_space(ring);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if( length > space )
+    {
+        length = space;
+    }
+    for( size_t i = 0; i < length; ++i )
+    {
+        ring->data[(tail + i) & (SESSION_INPUT_SIZE - 1)] = bytes[i];
+    }
+    atomic_store_explicit(&ring->tail, tail + (uint32_t)length, memory_order_release);
+    return length;
+}
+
+/* Next byte or -1 when empty, called by the consumer */
+static inline int input_ring_pop(struct input_ring* ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if( head == tail )
+    {
+        return -1;
+    }
+    uint8_t c = ring->data[head & (SESSION_INPUT_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return c;
+}
+
+static inline int input_ring_empty(struct input_ring* ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) ==
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif //LC3_SESSION_H
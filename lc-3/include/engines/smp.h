@@ -0,0 +1,487 @@
+#ifndef LC3_SMP_H
+#define LC3_SMP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../register_numbers.h"
+#include "../opcodes.h"
+#include "../condition_flags.h"
+#include "../trap_codes.h"
+#include "../memory_mapped_registers.h"
+#include "../utilities/sign_extension.h"
+#include "../utilities/check_key.h"
+
+/*
+    Symmetric multiprocessor LC-3.
+
+    Up to SMP_MAX_CPUS virtual CPUs, each with its own register file and running on its own host
+    thread, share one 64K word memory. Every CPU starts at the program start; guests tell the CPUs
+    apart by reading MMR_CPUID.
+
+    Ordinary loads and stores are relaxed atomic accesses: they never tear, but guests must use
+    the atomic unit (MMR_ATOMIC_*) to synchronise, and the doorbell (MMR_DOORBELL*) to wake a CPU
+    sleeping in MMR_DOORBELL_WAIT. The console is shared: input and output traps are serialised.
+    Instruction fetches always read memory: the device page is reached by data loads only.
+    KBSR behaves as in memory_read() with every CPU's reads taken in order: a poll that finds a
+    key sets it, and a data load of any other address by any CPU clears it.
+
+    A CPU executing HALT stops; the machine stops when every CPU has halted.
+*/
+
+#define SMP_MAX_CPUS 16
+#define SMP_MEMORY_WORDS (UINT16_MAX + 1)
+
+struct smp_machine;
+
+struct smp_cpu
+{
+    uint16_t registers[R_COUNT];
+    uint16_t id;
+
+    /* Atomic unit latches, private to the CPU */
+    uint16_t atomic_address;
+    uint16_t atomic_expected;
+    uint16_t atomic_result;
+
+    /* Bit n set: CPU n rang this CPU. Protected by machine->doorbell_lock */
+    uint16_t doorbells;
+
+    int halted;
+    uint64_t retired;
+
+    pthread_t thread;
+    struct smp_machine* machine;
+} __attribute__((aligned(64))); /* keep each CPU on its own cache lines */
+
+struct smp_machine
+{
+    uint16_t memory[SMP_MEMORY_WORDS];
+    struct smp_cpu cpus[SMP_MAX_CPUS];
+    int cpu_count;
+
+    /* Serialises the console between CPUs */
+    pthread_mutex_t console_lock;
+
+    pthread_mutex_t doorbell_lock;
+    pthread_cond_t doorbell_rung;
+    int halted_count;
+};
+
+static inline uint16_t smp_load(struct smp_machine* machine, uint16_t address)
+{
+    return __atomic_load_n(&machine->memory[address], __ATOMIC_RELAXED);
+}
+
+static inline void smp_store(struct smp_machine* machine, uint16_t address, uint16_t value)
+{
+    __atomic_store_n(&machine->memory[address], value, __ATOMIC_RELAXED);
+}
+
+/* Any data load but a KBSR poll clears KBSR. It is only written when set, so the line stays shared */
+static inline void smp_clear_kbsr(struct smp_machine* machine)
+{
+    if( smp_load(machine, MMR_KBSR) )
+    {
+        smp_store(machine, MMR_KBSR, 0);
+    }
+}
+
+/* Read of the device page (0xFE00 and up) */
+static uint16_t smp_device_read(struct smp_cpu* cpu, uint16_t address)
+{
+    struct smp_machine* machine = cpu->machine;
+    if( address != MMR_KBSR )
+    {
+        smp_clear_kbsr(machine);
+    }
+    switch(address)
+    {
+        case MMR_KBSR:
+            {
+                pthread_mutex_lock(&machine->console_lock);
+                if( check_key() )
+                {
+                    smp_store(machine, MMR_KBSR, 1 << 15);
+                    smp_store(machine, MMR_KBDR, (uint16_t)getchar());
+                }
+                else
+                {
+                    smp_store(machine, MMR_KBSR, 0);
+                }
+                pthread_mutex_unlock(&machine->console_lock);
+            }
+            break;
+        case MMR_CPUID:
+            return cpu->id;
+        case MMR_CPU_COUNT:
+            return (uint16_t)machine->cpu_count;
+        case MMR_ATOMIC_TAS:
+            return __atomic_exchange_n(&machine->memory[cpu->atomic_address], 1, __ATOMIC_SEQ_CST);
+        case MMR_ATOMIC_CAS:
+        case MMR_ATOMIC_ADD:
+            return cpu->atomic_result;
+        case MMR_DOORBELL:
+        case MMR_DOORBELL_WAIT:
+            {
+                pthread_mutex_lock(&machine->doorbell_lock);
+                if( address == MMR_DOORBELL_WAIT )
+                {
+                    /* Nobody can ring once every other CPU has halted */
+                    while( !cpu->doorbells && machine->halted_count < machine->cpu_count - 1 )
+                    {
+                        pthread_cond_wait(&machine->doorbell_rung, &machine->doorbell_lock);
+                    }
+                }
+                uint16_t doorbells = cpu->doorbells;
+                cpu->doorbells = 0;
+                pthread_mutex_unlock(&machine->doorbell_lock);
+                return doorbells;
+            }
+    }
+    return smp_load(machine, address);
+}
+
+/* Write to the device page (0xFE00 and up) */
+static void smp_device_write(struct smp_cpu* cpu, uint16_t address, uint16_t value)
+{
+    struct smp_machine* machine = cpu->machine;
+    switch(address)
+    {
+        case MMR_CPUID:
+        case MMR_CPU_COUNT:
+            /* Read only */
+            break;
+        case MMR_ATOMIC_ADDRESS:
+            cpu->atomic_address = value;
+            break;
+        case MMR_ATOMIC_EXPECTED:
+            cpu->atomic_expected = value;
+            break;
+        case MMR_ATOMIC_CAS:
+            {
+                uint16_t expected = cpu->atomic_expected;
+                /* On failure `expected` is updated to the current value, on success it already is */
+                __atomic_compare_exchange_n(&machine->memory[cpu->atomic_address], &expected, value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                cpu->atomic_result = expected;
+            }
+            break;
+        case MMR_ATOMIC_ADD:
+            cpu->atomic_result = __atomic_fetch_add(&machine->memory[cpu->atomic_address], value, __ATOMIC_SEQ_CST);
+            break;
+        case MMR_DOORBELL:
+            {
+                pthread_mutex_lock(&machine->doorbell_lock);
+                for( int target = 0; target < machine->cpu_count; ++target )
+                {
+                    if( value & (1u << target) )
+                    {
+                        machine->cpus[target].doorbells |= (uint16_t)(1u << cpu->id);
+                    }
+                }
+                pthread_cond_broadcast(&machine->doorbell_rung);
+                pthread_mutex_unlock(&machine->doorbell_lock);
+            }
+            break;
+        default:
+            smp_store(machine, address, value);
+            break;
+    }
+}
+
+static inline uint16_t smp_read(struct smp_cpu* cpu, uint16_t address)
+{
+    if( address >= MMR_KBSR )
+    {
+        return smp_device_read(cpu, address);
+    }
+    smp_clear_kbsr(cpu->machine);
+    return smp_load(cpu->machine, address);
+}
+
+static inline void smp_write(struct smp_cpu* cpu, uint16_t address, uint16_t value)
+{
+    if( address >= MMR_KBSR )
+    {
+        smp_device_write(cpu, address, value);
+        return;
+    }
+    smp_store(cpu->machine, address, value);
+}
+
+static inline void smp_update_condition_flags(uint16_t* registers, uint16_t r)
+{
+    uint16_t value = registers[r];
+    registers[R_COND] = value == 0 ? FL_ZER : (value >> 15) ? FL_NEG : FL_POS;
+}
+
+static void smp_halt(struct smp_cpu* cpu)
+{
+    struct smp_machine* machine = cpu->machine;
+    cpu->halted = 1;
+    pthread_mutex_lock(&machine->doorbell_lock);
+    int last = ++machine->halted_count == machine->cpu_count;
+    /* Waiters re-check whether anyone is left to ring them */
+    pthread_cond_broadcast(&machine->doorbell_rung);
+    pthread_mutex_unlock(&machine->doorbell_lock);
+    if( last )
+    {
+        pthread_mutex_lock(&machine->console_lock);
+        puts("HALT");
+        fflush(stdout);
+        pthread_mutex_unlock(&machine->console_lock);
+    }
+}
+
+static void smp_trap(struct smp_cpu* cpu, uint16_t vector)
+{
+    struct smp_machine* machine = cpu->machine;
+    uint16_t* registers = cpu->registers;
+    registers[R_R7] = registers[R_PC];
+
+    if( vector == TRAP_HALT )
+    {
+        smp_halt(cpu);
+        return;
+    }
+
+    pthread_mutex_lock(&machine->console_lock);
+    switch(vector)
+    {
+        case TRAP_GETC:
+            registers[R_R0] = (uint16_t)getchar();
+            smp_update_condition_flags(registers, R_R0);
+            break;
+        case TRAP_OUT:
+            putc((char)registers[R_R0], stdout);
+            fflush(stdout);
+            break;
+        case TRAP_PUTS:
+            {
+                uint16_t address = registers[R_R0];
+                uint16_t c;
+                while( (c = smp_load(machine, address++)) )
+                {
+                    putc((char)c, stdout);
+                }
+                fflush(stdout);
+            }
+            break;
+        case TRAP_IN:
+            {
+                printf("Enter a character: ");
+                char c = getchar();
+                putc(c, stdout);
+                registers[R_R0] = (uint16_t)c;
+                smp_update_condition_flags(registers, R_R0);
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                uint16_t address = registers[R_R0];
+                uint16_t word;
+                while( (word = smp_load(machine, address++)) )
+                {
+                    putc((char)(word & 0xFF), stdout);
+                    if( word >> 8 )
+                    {
+                        putc((char)(word >> 8), stdout);
+                    }
+                }
+                fflush(stdout);
+            }
+            break;
+    }
+    pthread_mutex_unlock(&machine->console_lock);
+}
+
+/* Thread body of a CPU: returns once the CPU halts. A bad opcode stops the whole process as in main.c */
+static void* smp_cpu_run(void* argument)
+{
+    struct smp_cpu* cpu = argument;
+    uint16_t* registers = cpu->registers;
+    uint64_t retired = 0;
+
+    while( !cpu->halted )
+    {
+        /* Fetches are plain memory reads: only data loads go to the devices */
+        uint16_t instruction = smp_load(cpu->machine, registers[R_PC]++);
+        ++retired;
+
+        switch(instruction >> 12)
+        {
+            case OP_ADD:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    if( (instruction >> 5) & 0x1 )
+                    {
+                        registers[r0] = registers[r1] + sign_extension(instruction & 0x1F, 5);
+                    }
+                    else
+                    {
+                        registers[r0] = registers[r1] + registers[instruction & 0x7];
+                    }
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_AND:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    if( (instruction >> 5) & 0x1 )
+                    {
+                        registers[r0] = registers[r1] & sign_extension(instruction & 0x1F, 5);
+                    }
+                    else
+                    {
+                        registers[r0] = registers[r1] & registers[instruction & 0x7];
+                    }
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_NOT:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = ~registers[(instruction >> 6) & 0x7];
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_BR:
+                if( ((instruction >> 9) & 0x7) & registers[R_COND] )
+                {
+                    registers[R_PC] += sign_extension(instruction & 0x1FF, 9);
+                }
+                break;
+
+            case OP_JMP:
+                registers[R_PC] = registers[(instruction >> 6) & 0x7];
+                break;
+
+            case OP_JSR:
+                {
+                    uint16_t base = registers[(instruction >> 6) & 0x7];
+                    registers[R_R7] = registers[R_PC];
+                    if( (instruction >> 11) & 1 )
+                    {
+                        registers[R_PC] += sign_extension(instruction & 0x7FF, 11);
+                    }
+                    else
+                    {
+                        registers[R_PC] = base;
+                    }
+                }
+                break;
+
+            case OP_LD:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = smp_read(cpu, registers[R_PC] + sign_extension(instruction & 0x1FF, 9));
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_LDI:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = smp_read(cpu, smp_read(cpu, registers[R_PC] + sign_extension(instruction & 0x1FF, 9)));
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_LDR:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    registers[r0] = smp_read(cpu, registers[r1] + sign_extension(instruction & 0x3F, 6));
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_LEA:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = registers[R_PC] + sign_extension(instruction & 0x1FF, 9);
+                    smp_update_condition_flags(registers, r0);
+                }
+                break;
+
+            case OP_ST:
+                smp_write(cpu, registers[R_PC] + sign_extension(instruction & 0x1FF, 9), registers[(instruction >> 9) & 0x7]);
+                break;
+
+            case OP_STI:
+                smp_write(cpu, smp_read(cpu, registers[R_PC] + sign_extension(instruction & 0x1FF, 9)), registers[(instruction >> 9) & 0x7]);
+                break;
+
+            case OP_STR:
+                {
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    smp_write(cpu, registers[r1] + sign_extension(instruction & 0x3F, 6), registers[(instruction >> 9) & 0x7]);
+                }
+                break;
+
+            case OP_TRAP:
+                smp_trap(cpu, instruction & 0xFF);
+                break;
+
+            case OP_RES:
+                /* Unused: fall through */
+            case OP_RTI:
+                /* Unused: fall through */
+            default:
+                pthread_mutex_lock(&cpu->machine->console_lock);
+                printf("Bad opcode on CPU %d, Aborting...\n", cpu->id);
+                fflush(stdout);
+                abort();
+                break;
+        }
+    }
+
+    cpu->retired = retired;
+    return NULL;
+}
+
+/* Prepare `cpu_count` CPUs on a machine whose memory is already loaded */
+void smp_init(struct smp_machine* machine, int cpu_count, uint16_t start)
+{
+    machine->cpu_count = cpu_count;
+    machine->halted_count = 0;
+    pthread_mutex_init(&machine->console_lock, NULL);
+    pthread_mutex_init(&machine->doorbell_lock, NULL);
+    pthread_cond_init(&machine->doorbell_rung, NULL);
+    for( int i = 0; i < cpu_count; ++i )
+    {
+        struct smp_cpu* cpu = &machine->cpus[i];
+        memset(cpu, 0, sizeof(*cpu));
+        cpu->id = (uint16_t)i;
+        cpu->machine = machine;
+        cpu->registers[R_PC] = start;
+        cpu->registers[R_COND] = FL_ZER;
+    }
+}
+
+/* Run every CPU on its own thread until all have halted. Returns 1 on SUCCESS, 0 on FAILURE */
+int smp_run(struct smp_machine* machine)
+{
+    for( int i = 0; i < machine->cpu_count; ++i )
+    {
+        if( pthread_create(&machine->cpus[i].thread, NULL, smp_cpu_run, &machine->cpus[i]) != 0 )
+        {
+            return 0;
+        }
+    }
+    for( int i = 0; i < machine->cpu_count; ++i )
+    {
+        pthread_join(machine->cpus[i].thread, NULL);
+    }
+    return 1;
+}
+
+#endif //LC3_SMP_H
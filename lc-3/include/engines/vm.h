@@ -0,0 +1,564 @@
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../register_numbers.h"
+#include "../opcodes.h"
+#include "../condition_flags.h"
+#include "../trap_codes.h"
+#include "../memory_mapped_registers.h"
+#include "../utilities/sign_extension.h"
+#include "../utilities/load_image.h"
+#include "../utilities/performance_counters.h"
+#include "../utilities/delay_loop_solver.h"
+
+/*
+    Self contained VM instance.
+
+    main.c runs a single VM on the global memory[] and registers[] with the terminal as its
+    console. Engines hosting several VMs in one process (fuzzing, serving sessions) use this
+    instead: the whole machine state lives in struct lc3_vm and console I/O goes through
+    the input/output hooks of the instance.
+
+    Execution semantics are those of the switch interpreter in main.c.
+*/
+
+#define VM_MEMORY_WORDS (UINT16_MAX + 1)
+/* Memory is tracked for dirtiness in pages of 256 words */
+#define VM_PAGE_SHIFT 8
+#define VM_PAGE_WORDS (1 << VM_PAGE_SHIFT)
+#define VM_PAGES (VM_MEMORY_WORDS / VM_PAGE_WORDS)
+/* Edge coverage map: one 8-bit counter per hashed (from, to) control transfer */
+#define VM_COVERAGE_SIZE (1 << 16)
+
+#define VM_PROGRAM_START 0x3000
+/* Reads and writes from here up may go to the device hooks */
+#define VM_DEVICE_BASE 0xFE00
+
+/* Reason vm_run() returned */
+enum
+{
+    VM_STOP_LIMIT = 0,  /* instruction budget used up */
+    VM_STOP_HALT,       /* TRAP HALT */
+    VM_STOP_BAD_OPCODE, /* RTI/RES: PC is left pointing after the bad instruction */
+    VM_STOP_INPUT,      /* waiting for input: calling vm_run() again once input is available resumes */
+    VM_STOP_HOST        /* the trap hook asked to stop: PC is left pointing after the TRAP */
+};
+
+/* Return value of the trap hook */
+enum
+{
+    VM_TRAP_DEFAULT = 0,    /* run the built-in trap routine (none for unassigned vectors) */
+    VM_TRAP_HANDLED,        /* the hook did the work */
+    VM_TRAP_STOP            /* the hook did the work, vm_run() returns VM_STOP_HOST */
+};
+
+struct lc3_vm
+{
+    uint16_t registers[R_COUNT];
+    uint16_t memory[VM_MEMORY_WORDS];
+
+    /* Bit per page written since the last vm_clear_dirty() */
+    uint64_t dirty[VM_PAGES / 64];
+
+    /* Returns the next input byte, or -1 when none is available */
+    int (*input)(void* context);
+    /* Receives console output */
+    void (*output)(void* context, const uint8_t* bytes, size_t length);
+    /* Called on every TRAP with R7 already holding the linkage, NULL for the built-in routines only */
+    int (*trap)(void* context, struct lc3_vm* vm, uint8_t vector);
+    /*
+        Memory mapped devices: called for accesses at VM_DEVICE_BASE and above.
+        Return 1 when the address belongs to a host device, 0 to fall back to memory and KBSR/KBDR.
+    */
+    int (*device_read)(void* context, uint16_t address, uint16_t* value);
+    int (*device_write)(void* context, uint16_t address, uint16_t value);
+    void* context;
+
+    /* Stop with VM_STOP_INPUT when KBSR is polled and no input is available, instead of spinning */
+    int stop_on_idle_poll;
+
+    /*
+        Run register-only delay loops in closed form, see delay_loops.h. They still count as
+        executed against the budget and in `retired`, but take no time: leave this off when
+        the guest paces itself with them. Each elided loop counts its edges once
+    */
+    int elide_delay_loops;
+    /* Instructions elided so far */
+    uint64_t elided;
+
+    /* Edge coverage counters, NULL to disable */
+    uint8_t* coverage;
+    /* Edges are folded into the map with this mask: its size, a power of two up to VM_COVERAGE_SIZE, less one */
+    uint16_t coverage_mask;
+
+    /*
+        Host performance counters per phase and subroutine, NULL to disable. Open them with
+        perf_counters_open() on the thread calling vm_run(). Time between vm_run() calls is
+        charged to the host phase
+    */
+    struct performance_counters* perf;
+
+    /* Images loaded so far: a later image may not overlap them */
+    struct image_extents images;
+
+    /* Instructions retired over the lifetime of the VM */
+    uint64_t retired;
+
+    /* Console output is batched and handed to output() once per trap */
+    uint8_t output_buffer[256];
+    size_t output_length;
+};
+
+/* Reset registers to the power-on state: PC at the program start, Z set */
+static inline void vm_reset_registers(struct lc3_vm* vm)
+{
+    memset(vm->registers, 0, sizeof(vm->registers));
+    vm->registers[R_COND] = FL_ZER;
+    vm->registers[R_PC] = VM_PROGRAM_START;
+}
+
+/*
+    Load an image held in a memory buffer (big endian, origin first) into the VM, see load_image.h.
+    Returns 1 on SUCCESS, 0 on FAILURE.
+*/
+static inline int vm_load_image(struct lc3_vm* vm, const uint8_t* image, size_t length)
+{
+    return load_image_buffer(vm->memory, &vm->images, image, length, "image");
+}
+
+/* Load an image file into the VM. Returns 1 on SUCCESS, 0 on FAILURE */
+static inline int vm_load_image_file(struct lc3_vm* vm, const char* image_path)
+{
+    return load_image_file(vm->memory, &vm->images, image_path);
+}
+
+/* Why the last image load failed, empty after a successful one */
+static inline const char* vm_load_error(const struct lc3_vm* vm)
+{
+    return vm->images.error;
+}
+
+static inline void vm_mark_dirty(struct lc3_vm* vm, uint16_t address)
+{
+    uint16_t page = address >> VM_PAGE_SHIFT;
+    vm->dirty[page >> 6] |= 1ull << (page & 63);
+}
+
+static inline void vm_clear_dirty(struct lc3_vm* vm)
+{
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+}
+
+static inline void vm_record_edge(struct lc3_vm* vm, uint16_t from, uint16_t to)
+{
+    if( vm->coverage )
+    {
+        /* AFL style edge hash: the multiply keeps A->B and B->A apart */
+        ++vm->coverage[(uint16_t)(from * 0x9E37u ^ to) & vm->coverage_mask];
+    }
+}
+
+static void vm_flush_output(struct lc3_vm* vm)
+{
+    if( vm->output_length && vm->output )
+    {
+        vm->output(vm->context, vm->output_buffer, vm->output_length);
+    }
+    vm->output_length = 0;
+}
+
+static inline void vm_putc(struct lc3_vm* vm, uint8_t c)
+{
+    if( vm->output_length == sizeof(vm->output_buffer) )
+    {
+        vm_flush_output(vm);
+    }
+    vm->output_buffer[vm->output_length++] = c;
+}
+
+static void vm_puts(struct lc3_vm* vm, const char* s)
+{
+    while(*s)
+    {
+        vm_putc(vm, (uint8_t)*s++);
+    }
+}
+
+static inline int vm_input(struct lc3_vm* vm)
+{
+    return vm->input ? vm->input(vm->context) : -1;
+}
+
+static inline void vm_update_condition_flags(struct lc3_vm* vm, uint16_t r)
+{
+    uint16_t value = vm->registers[r];
+    vm->registers[R_COND] = value == 0 ? FL_ZER : (value >> 15) ? FL_NEG : FL_POS;
+}
+
+static inline void vm_write(struct lc3_vm* vm, uint16_t address, uint16_t value)
+{
+    if( address >= VM_DEVICE_BASE && vm->device_write && vm->device_write(vm->context, address, value) )
+    {
+        return;
+    }
+    vm->memory[address] = value;
+    vm_mark_dirty(vm, address);
+}
+
+/* Read from the device page: host devices first, then KBSR/KBDR */
+static uint16_t vm_read_device(struct lc3_vm* vm, uint16_t address, int* idle)
+{
+    uint16_t value;
+    if( vm->device_read && vm->device_read(vm->context, address, &value) )
+    {
+        if( vm->memory[MMR_KBSR] )
+        {
+            vm->memory[MMR_KBSR] = 0;
+            vm_mark_dirty(vm, MMR_KBSR);
+        }
+        return value;
+    }
+    if( address == MMR_KBSR )
+    {
+        int c = vm_input(vm);
+        if( c >= 0 )
+        {
+            vm->memory[MMR_KBSR] = (1 << 15);
+            vm->memory[MMR_KBDR] = (uint16_t)c;
+        }
+        else
+        {
+            vm->memory[MMR_KBSR] = 0;
+            *idle = 1;
+        }
+        vm_mark_dirty(vm, MMR_KBSR);
+    }
+    else if( vm->memory[MMR_KBSR] )
+    {
+        vm->memory[MMR_KBSR] = 0;
+        vm_mark_dirty(vm, MMR_KBSR);
+    }
+    return vm->memory[address];
+}
+
+/*
+    Memory read with the MMIO semantics of memory_read().
+    Sets *idle when KBSR was polled without any input being available.
+*/
+static inline uint16_t vm_read(struct lc3_vm* vm, uint16_t address, int* idle)
+{
+    if( address >= VM_DEVICE_BASE )
+    {
+        return vm_read_device(vm, address, idle);
+    }
+    if( vm->memory[MMR_KBSR] )
+    {
+        vm->memory[MMR_KBSR] = 0;
+        vm_mark_dirty(vm, MMR_KBSR);
+    }
+    return vm->memory[address];
+}
+
+/*
+    Execute at most `max_instructions` instructions.
+    Returns the VM_STOP_* reason execution stopped.
+*/
+static int vm_run(struct lc3_vm* vm, uint64_t max_instructions)
+{
+    uint16_t* registers = vm->registers;
+    int stop = VM_STOP_LIMIT;
+    int idle = 0;
+    uint64_t executed = 0;
+    if( vm->perf )
+    {
+        perf_enter(vm->perf, vm->retired, PERF_PHASE_DISPATCH);
+    }
+
+    while( executed < max_instructions )
+    {
+        /* Fetch: only fetches from the device page go through the MMIO semantics of memory_read() */
+        uint16_t pc = registers[R_PC]++;
+        uint16_t instruction = pc >= VM_DEVICE_BASE ? vm_read(vm, pc, &idle) : vm->memory[pc];
+        ++executed;
+
+        switch(instruction >> 12)
+        {
+            case OP_ADD:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    if( (instruction >> 5) & 0x1 )
+                    {
+                        registers[r0] = registers[r1] + sign_extension(instruction & 0x1F, 5);
+                    }
+                    else
+                    {
+                        registers[r0] = registers[r1] + registers[instruction & 0x7];
+                    }
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_AND:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    if( (instruction >> 5) & 0x1 )
+                    {
+                        registers[r0] = registers[r1] & sign_extension(instruction & 0x1F, 5);
+                    }
+                    else
+                    {
+                        registers[r0] = registers[r1] & registers[instruction & 0x7];
+                    }
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_NOT:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = ~registers[(instruction >> 6) & 0x7];
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_BR:
+                {
+                    uint16_t condition_flags = (instruction >> 9) & 0x7;
+                    uint16_t pc_offset_9 = sign_extension(instruction & 0x1FF, 9);
+                    if( condition_flags & registers[R_COND] )
+                    {
+                        registers[R_PC] += pc_offset_9;
+                        vm_record_edge(vm, pc, registers[R_PC]);
+                        /* Backward branch: possibly a delay loop, elided no further than the budget */
+                        if( vm->elide_delay_loops && (pc_offset_9 >> 15) && executed < max_instructions )
+                        {
+                            uint16_t head = registers[R_PC];
+                            uint64_t elided = delay_loop_solve(vm->memory, registers, head, pc, max_instructions - executed);
+                            executed += elided;
+                            vm->elided += elided;
+                            if( registers[R_PC] != head )
+                            {
+                                /* The loop ran out: its exit edge */
+                                vm_record_edge(vm, pc, registers[R_PC]);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        vm_record_edge(vm, pc, registers[R_PC]);
+                    }
+                }
+                break;
+
+            case OP_JMP:
+                {
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    registers[R_PC] = registers[r1];
+                    vm_record_edge(vm, pc, registers[R_PC]);
+                    if( r1 == R_R7 && vm->perf )
+                    {
+                        perf_return(vm->perf, vm->retired + executed);
+                    }
+                }
+                break;
+
+            case OP_JSR:
+                {
+                    /* Read the base register first: JSRR R7 jumps to the old R7 */
+                    uint16_t base = registers[(instruction >> 6) & 0x7];
+                    registers[R_R7] = registers[R_PC];
+                    if( (instruction >> 11) & 1 )
+                    {
+                        registers[R_PC] += sign_extension(instruction & 0x7FF, 11);
+                    }
+                    else
+                    {
+                        registers[R_PC] = base;
+                    }
+                    vm_record_edge(vm, pc, registers[R_PC]);
+                    if( vm->perf )
+                    {
+                        perf_call(vm->perf, vm->retired + executed, registers[R_PC]);
+                    }
+                }
+                break;
+
+            case OP_LD:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = vm_read(vm, registers[R_PC] + sign_extension(instruction & 0x1FF, 9), &idle);
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_LDI:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t address = vm_read(vm, registers[R_PC] + sign_extension(instruction & 0x1FF, 9), &idle);
+                    registers[r0] = vm_read(vm, address, &idle);
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_LDR:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    registers[r0] = vm_read(vm, registers[r1] + sign_extension(instruction & 0x3F, 6), &idle);
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_LEA:
+                {
+                    uint16_t r0 = (instruction >> 9) & 0x7;
+                    registers[r0] = registers[R_PC] + sign_extension(instruction & 0x1FF, 9);
+                    vm_update_condition_flags(vm, r0);
+                }
+                break;
+
+            case OP_ST:
+                vm_write(vm, registers[R_PC] + sign_extension(instruction & 0x1FF, 9), registers[(instruction >> 9) & 0x7]);
+                break;
+
+            case OP_STI:
+                {
+                    uint16_t address = vm_read(vm, registers[R_PC] + sign_extension(instruction & 0x1FF, 9), &idle);
+                    vm_write(vm, address, registers[(instruction >> 9) & 0x7]);
+                }
+                break;
+
+            case OP_STR:
+                {
+                    uint16_t r1 = (instruction >> 6) & 0x7;
+                    vm_write(vm, registers[r1] + sign_extension(instruction & 0x3F, 6), registers[(instruction >> 9) & 0x7]);
+                }
+                break;
+
+            case OP_TRAP:
+                {
+                    uint16_t linkage = registers[R_PC];
+                    if( vm->perf )
+                    {
+                        perf_enter(vm->perf, vm->retired + executed, PERF_PHASE_TRAP);
+                    }
+                    if( vm->trap )
+                    {
+                        registers[R_R7] = linkage;
+                        int action = vm->trap(vm->context, vm, (uint8_t)(instruction & 0xFF));
+                        if( action == VM_TRAP_STOP )
+                        {
+                            stop = VM_STOP_HOST;
+                            goto done;
+                        }
+                        if( action == VM_TRAP_HANDLED )
+                        {
+                            if( vm->perf )
+                            {
+                                perf_enter(vm->perf, vm->retired + executed, PERF_PHASE_DISPATCH);
+                            }
+                            break;
+                        }
+                    }
+                    switch(instruction & 0xFF)
+                    {
+                        case TRAP_GETC:
+                        case TRAP_IN:
+                            {
+                                int c = vm_input(vm);
+                                if( c < 0 )
+                                {
+                                    /* Re-execute the trap once input arrives */
+                                    registers[R_PC] = pc;
+                                    --executed;
+                                    stop = VM_STOP_INPUT;
+                                    goto done;
+                                }
+                                if( (instruction & 0xFF) == TRAP_IN )
+                                {
+                                    vm_puts(vm, "Enter a character: ");
+                                    vm_putc(vm, (uint8_t)c);
+                                }
+                                registers[R_R0] = (uint16_t)c;
+                                vm_update_condition_flags(vm, R_R0);
+                            }
+                            break;
+                        case TRAP_OUT:
+                            vm_putc(vm, (uint8_t)registers[R_R0]);
+                            break;
+                        case TRAP_PUTS:
+                            {
+                                uint16_t address = registers[R_R0];
+                                while(vm->memory[address])
+                                {
+                                    vm_putc(vm, (uint8_t)vm->memory[address++]);
+                                }
+                            }
+                            break;
+                        case TRAP_PUTSP:
+                            {
+                                uint16_t address = registers[R_R0];
+                                while(vm->memory[address])
+                                {
+                                    uint16_t word = vm->memory[address++];
+                                    vm_putc(vm, (uint8_t)(word & 0xFF));
+                                    if( word >> 8 )
+                                    {
+                                        vm_putc(vm, (uint8_t)(word >> 8));
+                                    }
+                                }
+                            }
+                            break;
+                        case TRAP_HALT:
+                            vm_puts(vm, "HALT\n");
+                            stop = VM_STOP_HALT;
+                            break;
+                    }
+                    registers[R_R7] = linkage;
+                    vm_flush_output(vm);
+                    if( vm->perf )
+                    {
+                        perf_enter(vm->perf, vm->retired + executed, PERF_PHASE_DISPATCH);
+                    }
+                    if( stop == VM_STOP_HALT )
+                    {
+                        goto done;
+                    }
+                }
+                break;
+
+            case OP_RES:
+                /* Unused: fall through */
+            case OP_RTI:
+                /* Unused: fall through */
+            default:
+                stop = VM_STOP_BAD_OPCODE;
+                goto done;
+        }
+
+        if( idle && vm->stop_on_idle_poll )
+        {
+            stop = VM_STOP_INPUT;
+            break;
+        }
+        idle = 0;
+    }
+
+done:
+    vm->retired += executed;
+    vm_flush_output(vm);
+    if( vm->perf )
+    {
+        perf_enter(vm->perf, vm->retired, PERF_PHASE_HOST);
+    }
+    return stop;
+}
+
+#endif //LC3_VM_H
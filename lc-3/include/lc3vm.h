@@ -0,0 +1,117 @@
+#ifndef LC3VM_H
+#define LC3VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    liblc3vm: the LC-3 VM as a library.
+
+    Every VM is an independent instance: nothing is global, nothing prints on its own and
+    nothing exits the process. Console, trap and memory mapped I/O go through host callbacks.
+
+        struct lc3_vm* vm = lc3vm_create();
+        lc3vm_load_image(vm, image, image_length);
+        while( lc3vm_run(vm, 1000000) == LC3VM_STOP_LIMIT )
+        {
+            ...service the host between slices...
+        }
+        lc3vm_destroy(vm);
+
+    Link with -llc3vm (liblc3vm.a or liblc3vm.so). A VM must only be used by one thread at a
+    time; different VMs may run on different threads.
+*/
+
+#if defined(__GNUC__)
+#define LC3VM_API __attribute__((visibility("default")))
+#else
+#define LC3VM_API
+#endif
+
+struct lc3_vm;
+
+/* Reason lc3vm_run() returned */
+enum
+{
+    LC3VM_STOP_LIMIT = 0,   /* instruction budget used up */
+    LC3VM_STOP_HALT,        /* TRAP HALT */
+    LC3VM_STOP_BAD_OPCODE,  /* RTI/RES: PC is left pointing after the bad instruction */
+    LC3VM_STOP_INPUT,       /* waiting for input: calling lc3vm_run() again once input is available resumes */
+    LC3VM_STOP_HOST         /* the trap callback returned LC3VM_TRAP_STOP */
+};
+
+/* Return value of the trap callback */
+enum
+{
+    LC3VM_TRAP_DEFAULT = 0, /* run the built-in trap routine (none for unassigned vectors) */
+    LC3VM_TRAP_HANDLED,     /* the callback did the work */
+    LC3VM_TRAP_STOP         /* the callback did the work, lc3vm_run() returns LC3VM_STOP_HOST */
+};
+
+enum
+{
+    LC3VM_R0 = 0,
+    LC3VM_R1,
+    LC3VM_R2,
+    LC3VM_R3,
+    LC3VM_R4,
+    LC3VM_R5,
+    LC3VM_R6,
+    LC3VM_R7,
+    LC3VM_PC,
+    LC3VM_COND
+};
+
+/*
+    Host callbacks, all optional. `context` is the pointer given to lc3vm_set_callbacks().
+
+    input:        next keyboard byte, or -1 when none is available
+    output:       console output, handed over once per trap
+    trap:         called on every TRAP before the built-in routine, with R7 already holding the linkage
+    device_read:  reads at 0xFE00 and above. Return 1 and set *value for a host device,
+                  0 to fall back to memory and the KBSR/KBDR keyboard
+    device_write: writes at 0xFE00 and above. Return 1 for a host device, 0 to write memory
+*/
+struct lc3vm_callbacks
+{
+    int (*input)(void* context);
+    void (*output)(void* context, const uint8_t* bytes, size_t length);
+    int (*trap)(void* context, struct lc3_vm* vm, uint8_t vector);
+    int (*device_read)(void* context, uint16_t address, uint16_t* value);
+    int (*device_write)(void* context, uint16_t address, uint16_t value);
+};
+
+/* New VM with zeroed memory, PC at 0x3000 and Z set. NULL when out of memory */
+LC3VM_API struct lc3_vm* lc3vm_create(void);
+LC3VM_API void lc3vm_destroy(struct lc3_vm* vm);
+
+/* Load a big endian .obj image held in memory. Returns 1 on SUCCESS, 0 if it does not fit above its origin or overlaps an image loaded before */
+LC3VM_API int lc3vm_load_image(struct lc3_vm* vm, const void* image, size_t length);
+/* Why the last lc3vm_load_image() failed, for the host to report. Empty after a successful load */
+LC3VM_API const char* lc3vm_load_error(const struct lc3_vm* vm);
+/* Registers back to the power-on state. Memory is left alone */
+LC3VM_API void lc3vm_reset(struct lc3_vm* vm);
+
+LC3VM_API void lc3vm_set_callbacks(struct lc3_vm* vm, const struct lc3vm_callbacks* callbacks, void* context);
+/* Return LC3VM_STOP_INPUT when the program polls KBSR without input instead of letting it spin */
+LC3VM_API void lc3vm_set_stop_on_idle_poll(struct lc3_vm* vm, int enabled);
+/*
+    Run loops that only count registers in closed form. Elided instructions count against the
+    budget and as retired but take no time, so leave this off for guests pacing themselves
+*/
+LC3VM_API void lc3vm_set_delay_loop_elision(struct lc3_vm* vm, int enabled);
+
+/* Execute at most `max_instructions` instructions. Returns an LC3VM_STOP_* reason */
+LC3VM_API int lc3vm_run(struct lc3_vm* vm, uint64_t max_instructions);
+/* Instructions retired since lc3vm_create() */
+LC3VM_API uint64_t lc3vm_retired(const struct lc3_vm* vm);
+/* Of those, instructions elided in delay loops */
+LC3VM_API uint64_t lc3vm_elided(const struct lc3_vm* vm);
+
+/* Register and memory access for the host. Memory access bypasses the device callbacks */
+LC3VM_API uint16_t lc3vm_get_register(const struct lc3_vm* vm, int r);
+LC3VM_API void lc3vm_set_register(struct lc3_vm* vm, int r, uint16_t value);
+LC3VM_API uint16_t lc3vm_read_memory(const struct lc3_vm* vm, uint16_t address);
+LC3VM_API void lc3vm_write_memory(struct lc3_vm* vm, uint16_t address, uint16_t value);
+
+#endif //LC3VM_H
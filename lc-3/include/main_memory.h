@@ -3,7 +3,7 @@
 
 //MAIN MEMORY
 //65,536 memory locations
-uint16_t memory[UINT16_MAX];	//Array length is the maximum representable value of 16-bit integer i.e. 0xFFFF
+uint16_t memory[UINT16_MAX + 1];	//One word for every address 0x0000 through 0xFFFF
 
 /* 
     Memory locations 0x0000 through 0x00FF (256 total) are available to containt address for system calls specified by their corresponding trap vectors. 
@@ -9,4 +9,20 @@ enum {
     MMR_KBSR = 0xFE00, /* Keyboard Status Register: indicates whether a key has been pressed */
     MMR_KBDR = 0xFE02 /* Keyboard Data Register: contains the last key that was pressed */
 };
+
+/*
+ Multiprocessor devices, only present in lc3-smp (see include/engines/smp.h).
+ The atomic unit operates on the word whose address was last written to MMR_ATOMIC_ADDRESS by the same CPU.
+*/
+enum {
+    MMR_CPUID = 0xFE10,             /* Read: index of the executing CPU */
+    MMR_CPU_COUNT = 0xFE12,         /* Read: number of CPUs */
+    MMR_ATOMIC_ADDRESS = 0xFE14,    /* Write: address operated on by the atomic unit */
+    MMR_ATOMIC_EXPECTED = 0xFE16,   /* Write: expected value for MMR_ATOMIC_CAS */
+    MMR_ATOMIC_CAS = 0xFE18,        /* Write: compare-exchange the word with the value written. Read: value the word held before the last CAS/ADD */
+    MMR_ATOMIC_TAS = 0xFE1A,        /* Read: test-and-set, atomically sets the word to 1 and returns its previous value */
+    MMR_ATOMIC_ADD = 0xFE1C,        /* Write: atomically add the value written to the word. Read: same as MMR_ATOMIC_CAS */
+    MMR_DOORBELL = 0xFE20,          /* Write: ring the CPUs in the mask written (bit n is CPU n). Read: take and clear the pending doorbells of this CPU */
+    MMR_DOORBELL_WAIT = 0xFE22      /* Read: sleep until a doorbell is pending, then take and clear it. 0 if no other CPU is left to ring */
+};
 #endif //MEMORY_MAPPED_REGISTERS_H
@@ -0,0 +1,172 @@
+#ifndef LC3_DELAY_LOOP_SOLVER_H
+#define LC3_DELAY_LOOP_SOLVER_H
+
+#include <stdint.h>
+
+#include "../register_numbers.h"
+#include "../memory_mapped_registers.h"
+#include "../opcodes.h"
+#include "../condition_flags.h"
+#include "./sign_extension.h"
+
+/*
+    Closed form delay loops on any memory and register file: delay_loops.h runs them on the
+    global memory[] and registers[] of main.c, vm.h on a struct lc3_vm. What makes a delay
+    loop and how its iterations are counted is described in delay_loops.h.
+*/
+
+/* Longest body decoded, branch excluded */
+#define DELAY_LOOP_MAX_BODY 16
+/* Times the counting register may move from one of n, z, p to another before we give up */
+#define DELAY_LOOP_MAX_PASSES 8
+
+/*
+    Iterations until the branch falls through, counting the last one. The branch tests `value`
+    in the first iteration and `step` more in each one after it; it is taken while the flag
+    of the value is in `taken`. Returns 0 for a loop that does not exit or that we cannot solve.
+*/
+static uint64_t delay_loop_iterations(uint16_t value, uint16_t step, uint16_t taken)
+{
+    uint64_t iterations = 0;
+    if( step == 0 )
+    {
+        return 0;
+    }
+    for( int pass = 0; pass < DELAY_LOOP_MAX_PASSES; ++pass )
+    {
+        uint16_t flag = value == 0 ? FL_ZER : (value >> 15 ? FL_NEG : FL_POS);
+        if( !(flag & taken) )
+        {
+            return iterations + 1;
+        }
+        /* Iterations while the value stays zero, positive (1 to x7FFF) or negative (x8000 to xFFFF) */
+        uint64_t stay = 1;
+        if( flag != FL_ZER )
+        {
+            uint16_t low = flag == FL_POS ? 0x0001 : 0x8000;
+            uint16_t high = flag == FL_POS ? 0x7FFF : 0xFFFF;
+            if( step >> 15 )
+            {
+                stay += (uint16_t)(value - low) / (uint16_t)-step;
+            }
+            else
+            {
+                stay += (uint16_t)(high - value) / step;
+            }
+        }
+        iterations += stay;
+        value += (uint16_t)(stay * step);
+    }
+    return 0;
+}
+
+/*
+    Called after the BR at `branch` jumped back to `head`, with `registers` at the start of an
+    iteration. Runs the remaining iterations, at most `limit` instructions, if the loop is a
+    delay loop: registers, condition codes and PC end up as if each had been executed.
+    Returns the number of instructions elided, a whole number of iterations.
+*/
+static uint64_t delay_loop_solve(const uint16_t* memory, uint16_t* registers, uint16_t head, uint16_t branch, uint64_t limit)
+{
+    /* Bodies wrapping around memory or fetching from the device registers are not delay loops */
+    if( head > branch || branch - head > DELAY_LOOP_MAX_BODY || branch >= MMR_KBSR )
+    {
+        return 0;
+    }
+
+    /*
+        Each register is followed through one iteration as the value some register had at the
+        start of it plus a constant. A register that ends up based on its own start value
+        steps by that constant every iteration; one based on such a register copies it.
+    */
+    int base[8];
+    uint16_t offset[8] = { 0 };
+    for( int r = 0; r < 8; ++r )
+    {
+        base[r] = r;
+    }
+    int written = 0;
+    int read = 0;
+    int counter = -1;
+    for( uint16_t address = head; address < branch; ++address )
+    {
+        uint16_t instruction = memory[address];
+        uint16_t r0 = (instruction >> 9) & 0x7;
+        uint16_t r1 = (instruction >> 6) & 0x7;
+        if( instruction >> 12 != OP_ADD )
+        {
+            return 0;
+        }
+        uint16_t added;
+        if( (instruction >> 5) & 0x1 )
+        {
+            added = sign_extension(instruction & 0x1F, 5);
+        }
+        else
+        {
+            uint16_t r2 = instruction & 0x7;
+            added = registers[r2];
+            read |= 1 << r2;
+        }
+        base[r0] = base[r1];
+        offset[r0] = offset[r1] + added;
+        written |= 1 << r0;
+        counter = r0;
+    }
+    /* A register added in must keep its value over the whole loop, a copied one must step */
+    if( counter < 0 || (read & written) )
+    {
+        return 0;
+    }
+    for( int r = 0; r < 8; ++r )
+    {
+        if( base[base[r]] != base[r] )
+        {
+            return 0;
+        }
+    }
+
+    /*
+        After k iterations a stepping register is its start value plus k steps. A copy of one
+        is the start value of what it copies, plus k - 1 of its steps, plus its own offset.
+        The counter after the first iteration is what the branch tests first.
+    */
+    uint16_t step = offset[base[counter]];
+    uint16_t taken = (memory[branch] >> 9) & 0x7;
+    uint64_t iterations = delay_loop_iterations(registers[base[counter]] + offset[counter], step, taken);
+    uint64_t length = (uint64_t)(branch - head) + 1;
+    if( iterations == 0 )
+    {
+        return 0;
+    }
+    int exits = 1;
+    if( iterations > limit / length )
+    {
+        /* Stop at the loop head with the last iteration before the limit done */
+        iterations = limit / length;
+        exits = 0;
+        if( iterations == 0 )
+        {
+            return 0;
+        }
+    }
+
+    uint16_t start[8];
+    for( int r = 0; r < 8; ++r )
+    {
+        start[r] = registers[r];
+    }
+    for( int r = 0; r < 8; ++r )
+    {
+        int b = base[r];
+        uint64_t steps = b == r ? iterations : iterations - 1;
+        registers[r] = start[b] + (uint16_t)(steps * offset[b]) + (b == r ? 0 : offset[r]);
+    }
+    /* The counter is the last register the body writes: its final value sets the flags */
+    uint16_t value = registers[counter];
+    registers[R_COND] = value == 0 ? FL_ZER : (value >> 15 ? FL_NEG : FL_POS);
+    registers[R_PC] = exits ? branch + 1 : head;
+    return iterations * length;
+}
+
+#endif //LC3_DELAY_LOOP_SOLVER_H
@@ -0,0 +1,115 @@
+#ifndef LC3_DELAY_LOOPS_H
+#define LC3_DELAY_LOOPS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../main_memory.h"
+#include "../registers.h"
+#include "../opcodes.h"
+#include "./delay_loop_solver.h"
+#include "./live_statistics.h"
+
+/*
+    Delay loop elision, enabled with LC3_DELAY_LOOPS=1.
+
+    Programs pace themselves with loops that only count a register down:
+
+        LD  R1, COUNT
+        loop: ADD R1, R1, #-1
+              BRp loop
+
+    When a branch jumps back to a loop head, the body is decoded. Every instruction must be
+    ADD Rx, Ry, #imm or ADD Rx, Ry, Rz, where no instruction in the body writes Rz. A body
+    like that touches no memory, devices or traps. Every register must either change by a
+    constant each iteration or end it as a copy, plus a constant, of one that does, as R2
+    does in the remainder loop
+
+        loop: ADD R0, R0, R1
+              ADD R2, R0, #0
+              BRzp loop
+
+    The condition codes the branch tests come from the last ADD, so the number of iterations
+    follows from where that register starts, how far it moves per iteration and which of
+    n, z and p keep the loop going. The remaining iterations are
+    applied at once: registers, condition codes, PC and the instruction counts end up
+    exactly as if each iteration had been executed.
+
+    `limit` caps the instructions elided, so checkpoints and debugger stops (see
+    time_travel.h) still land on their instruction. Loops that never exit are left alone.
+
+    Elided loops take no time, which breaks programs that rely on them for pacing. With
+    LC3_DELAY_LOOP_NS=<ns> every elided instruction costs that much virtual time, and the VM
+    sleeps off the total in steps of at least a millisecond. The host nanoseconds per guest
+    instruction reported with LC3_PERF=1 (see performance_counters.h) is a good value.
+
+    The loops are solved in delay_loop_solver.h, shared with vm.h; this adds the statistics,
+    pacing and report of main.c.
+*/
+
+/* Smallest sleep taken to pay back virtual time */
+#define DELAY_LOOP_MIN_SLEEP_NS 1000000
+
+struct delay_loops
+{
+    int enabled;
+    /* Virtual time per elided instruction, 0 to run elided loops in no time */
+    uint64_t pace_ns;
+    /* Virtual time not slept yet */
+    uint64_t owed_ns;
+    uint64_t elided;
+    uint64_t loops;
+};
+
+struct delay_loops delay_loops;
+
+/* Pay back virtual time once enough is owed for a sleep to be accurate */
+static void delay_loop_pace(uint64_t instructions)
+{
+    delay_loops.owed_ns += instructions * delay_loops.pace_ns;
+    if( delay_loops.owed_ns >= DELAY_LOOP_MIN_SLEEP_NS )
+    {
+        struct timespec owed = { (time_t)(delay_loops.owed_ns / 1000000000u), (long)(delay_loops.owed_ns % 1000000000u) };
+        nanosleep(&owed, NULL);
+        delay_loops.owed_ns = 0;
+    }
+}
+
+/*
+    Called after the BR at `branch` jumped back to `head`, with registers[] at the start of an
+    iteration. Runs the remaining iterations, at most `limit` instructions, if the loop is a
+    delay loop. Returns the number of instructions elided.
+*/
+uint64_t delay_loop_elide(uint16_t head, uint16_t branch, uint64_t limit)
+{
+    uint64_t instructions = delay_loop_solve(memory, registers, head, branch, limit);
+    if( instructions == 0 )
+    {
+        return 0;
+    }
+    /* Every instruction of the body is an ADD */
+    uint64_t iterations = instructions / ((uint64_t)(branch - head) + 1);
+    statistics.opcodes[OP_ADD] += iterations * (uint64_t)(branch - head);
+    statistics.opcodes[OP_BR] += iterations;
+    delay_loops.elided += instructions;
+    ++delay_loops.loops;
+    if( delay_loops.pace_ns )
+    {
+        delay_loop_pace(instructions);
+    }
+    return instructions;
+}
+
+/* Report the instructions elided on stderr. Registered with atexit() */
+void delay_loops_report(void)
+{
+    if( !delay_loops.enabled )
+    {
+        return;
+    }
+    fprintf(stderr, "Delay loops: %llu instructions elided in %llu loops\n",
+            (unsigned long long)delay_loops.elided, (unsigned long long)delay_loops.loops);
+}
+
+#endif //LC3_DELAY_LOOPS_H
@@ -0,0 +1,150 @@
+#ifndef LC3_LIVE_STATISTICS_H
+#define LC3_LIVE_STATISTICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+    Live statistics of a running VM, published in the shared memory segment /lc3-stats-<pid>
+    (/dev/shm/lc3-stats-<pid> on Linux) and read by lc3-top.
+
+    The interpreter counts into the plain process local `statistics` and copies the counters
+    into the segment every STATISTICS_BATCH instructions and around blocking input, with
+    relaxed atomic stores. Readers get a consistent enough view for monitoring without the
+    hot loop ever touching shared cache lines.
+*/
+
+#define STATISTICS_MAGIC 0x4C433353 /* "LC3S" */
+#define STATISTICS_VERSION 1
+#define STATISTICS_PREFIX "lc3-stats-"
+/* Publish every 2^20 instructions: a few hundred times a second at full speed */
+#define STATISTICS_BATCH_MASK ((1u << 20) - 1)
+/* Most instructions between two KBSR polls finding no key for the time between them to count as idle */
+#define STATISTICS_IDLE_POLL_GAP 16
+
+struct shared_statistics
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    char image[64];
+    uint64_t started_ns;
+
+    _Atomic uint64_t updated_ns;
+    _Atomic uint64_t instructions;
+    _Atomic uint64_t opcodes[16];
+    _Atomic uint64_t traps[256];
+    _Atomic uint64_t kbsr_polls;
+    _Atomic uint64_t bytes_output;
+    _Atomic uint64_t write_syscalls;
+    _Atomic uint64_t idle_ns;
+};
+
+/* Process local counters, updated by the interpreter */
+struct local_statistics
+{
+    uint64_t opcodes[16];
+    uint64_t traps[256];
+    uint64_t kbsr_polls;
+    uint64_t bytes_output;
+    uint64_t write_syscalls;
+    uint64_t idle_ns;
+    /* Time and instruction count of the last KBSR poll that found no key, 0 when the last poll found one */
+    uint64_t empty_poll_ns;
+    uint64_t empty_poll_instruction;
+};
+
+struct local_statistics statistics;
+struct shared_statistics* shared_statistics;
+char shared_statistics_name[32];
+
+static inline uint64_t statistics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Remove the segment. Registered with atexit() */
+void statistics_close(void)
+{
+    if( shared_statistics )
+    {
+        munmap(shared_statistics, sizeof(struct shared_statistics));
+        shm_unlink(shared_statistics_name);
+        shared_statistics = NULL;
+    }
+}
+
+/* Create the segment. Statistics are best effort: on failure the VM runs without them */
+void statistics_open(const char* image)
+{
+    snprintf(shared_statistics_name, sizeof(shared_statistics_name), "/" STATISTICS_PREFIX "%d", (int)getpid());
+    int fd = shm_open(shared_statistics_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if( fd < 0 )
+    {
+        return;
+    }
+    if( ftruncate(fd, sizeof(struct shared_statistics)) < 0 )
+    {
+        close(fd);
+        shm_unlink(shared_statistics_name);
+        return;
+    }
+    void* segment = mmap(NULL, sizeof(struct shared_statistics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( segment == MAP_FAILED )
+    {
+        shm_unlink(shared_statistics_name);
+        return;
+    }
+    shared_statistics = segment;
+    shared_statistics->version = STATISTICS_VERSION;
+    shared_statistics->pid = (int32_t)getpid();
+    snprintf(shared_statistics->image, sizeof(shared_statistics->image), "%s", image);
+    shared_statistics->started_ns = statistics_now_ns();
+    atomic_store_explicit(&shared_statistics->updated_ns, shared_statistics->started_ns, memory_order_relaxed);
+    /* Readers ignore the segment until the magic is set */
+    atomic_thread_fence(memory_order_release);
+    shared_statistics->magic = STATISTICS_MAGIC;
+    atexit(statistics_close);
+}
+
+/* Copy the local counters into the segment */
+void statistics_publish(void)
+{
+    struct shared_statistics* s = shared_statistics;
+    if( !s )
+    {
+        return;
+    }
+    uint64_t instructions = 0;
+    for( int op = 0; op < 16; ++op )
+    {
+        instructions += statistics.opcodes[op];
+        atomic_store_explicit(&s->opcodes[op], statistics.opcodes[op], memory_order_relaxed);
+    }
+    for( int vector = 0; vector < 256; ++vector )
+    {
+        if( statistics.traps[vector] )
+        {
+            atomic_store_explicit(&s->traps[vector], statistics.traps[vector], memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&s->instructions, instructions, memory_order_relaxed);
+    atomic_store_explicit(&s->kbsr_polls, statistics.kbsr_polls, memory_order_relaxed);
+    atomic_store_explicit(&s->bytes_output, statistics.bytes_output, memory_order_relaxed);
+    atomic_store_explicit(&s->write_syscalls, statistics.write_syscalls, memory_order_relaxed);
+    atomic_store_explicit(&s->idle_ns, statistics.idle_ns, memory_order_relaxed);
+    atomic_store_explicit(&s->updated_ns, statistics_now_ns(), memory_order_relaxed);
+}
+
+#endif //LC3_LIVE_STATISTICS_H
@@ -0,0 +1,171 @@
+#ifndef LC3_LOAD_IMAGE_H
+#define LC3_LOAD_IMAGE_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "switch_endian.h"
+
+/*NOTE: LC3 is a big endian system*/
+/*
+	An image is its origin followed by the words to place there, all big endian.
+	Files are read straight into memory at their origin and byte swapped in place: there is
+	no staging buffer. (Mapping the file instead measured slower: setting up and tearing down
+	the mapping costs more than the single copy read() makes, even for a full 64K word image.)
+	An image is a whole number of words: a trailing odd byte fails the load. Every image must
+	fit between its origin and the end of memory, and images loaded into the same memory must
+	not overlap: an overlap fails the load. An image is only claimed once it is in memory.
+	Nothing here prints: why a load failed is left in the extents' error string for the
+	driver to report.
+
+	These work on any 64K word memory with the extents claimed in it so far: read_image_file.h
+	loads into the global memory[], vm.h into a struct lc3_vm.
+*/
+
+/* Images loaded into one memory, at most */
+#define IMAGE_EXTENTS_MAX 32
+/* Longest error message kept, longer ones are cut */
+#define IMAGE_ERROR_MAX 256
+
+/* Words of memory taken by an image */
+struct image_extent
+{
+	uint32_t first;
+	uint32_t end;	/* one past the last word */
+	const char* name;
+};
+
+/* The images loaded into one memory so far. Zeroed is empty */
+struct image_extents
+{
+	size_t count;
+	struct image_extent extent[IMAGE_EXTENTS_MAX];
+	/* Why the last load failed, empty after a successful one */
+	char error[IMAGE_ERROR_MAX];
+};
+
+/* Check that `words` words fit at `origin` without overlapping an image loaded before */
+static int check_image_extent(struct image_extents* extents, uint16_t origin, size_t words, const char* name)
+{
+	if( words > (size_t)(UINT16_MAX + 1 - origin) )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: %zu words at x%04X run past the end of memory", name, words, origin);
+		return 0;
+	}
+	if( words == 0 )
+	{
+		return 1;
+	}
+
+	struct image_extent extent = { origin, origin + (uint32_t)words, name };
+	for( size_t i = 0; i < extents->count; ++i )
+	{
+		const struct image_extent* other = &extents->extent[i];
+		if( extent.first < other->end && other->first < extent.end )
+		{
+			snprintf(extents->error, sizeof(extents->error), "%s (x%04X-x%04X) overlaps %s (x%04X-x%04X)",
+			         name, extent.first, extent.end - 1, other->name, other->first, other->end - 1);
+			return 0;
+		}
+	}
+	if( extents->count == IMAGE_EXTENTS_MAX )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: more than %d images", name, IMAGE_EXTENTS_MAX);
+		return 0;
+	}
+	return 1;
+}
+
+/* Record an image that passed check_image_extent() once it is in memory */
+static void claim_image_extent(struct image_extents* extents, uint16_t origin, size_t words, const char* name)
+{
+	if( words )
+	{
+		struct image_extent extent = { origin, origin + (uint32_t)words, name };
+		extents->extent[extents->count++] = extent;
+	}
+}
+
+/*
+	Load an image held in a buffer into `memory`. `name` is used in error messages and must
+	outlive the memory it is loaded into.
+	Returns 1 on SUCCESS, 0 on FAILURE with extents->error saying why.
+*/
+static inline int load_image_buffer(uint16_t* memory, struct image_extents* extents, const uint8_t* image, size_t length, const char* name)
+{
+	extents->error[0] = '\0';
+	if( length < 2 )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: no origin", name);
+		return 0;
+	}
+	if( length % 2 )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: odd number of bytes, the last word is cut short", name);
+		return 0;
+	}
+	/* The origin tells us where in memory to place the file/image */
+	uint16_t origin = (uint16_t)(image[0] << 8 | image[1]);
+	size_t words = (length - 2) / 2;
+	if( !check_image_extent(extents, origin, words, name) )
+	{
+		return 0;
+	}
+	/* Switch the image to host order on the way into memory */
+	switch_endian_copy(memory + origin, image + 2, words);
+	claim_image_extent(extents, origin, words, name);
+	return 1;
+}
+
+/* Load an image file into `memory`. Returns 1 on SUCCESS, 0 on FAILURE with extents->error saying why */
+static inline int load_image_file(uint16_t* memory, struct image_extents* extents, const char* image_path)
+{
+	extents->error[0] = '\0';
+	int fd = open(image_path, O_RDONLY);
+	if( fd < 0 )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: %s", image_path, strerror(errno));
+		return 0;
+	}
+	struct stat status;
+	uint8_t origin_bytes[2];
+	if( fstat(fd, &status) < 0 || status.st_size < 2 || pread(fd, origin_bytes, 2, 0) != 2 )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: no origin", image_path);
+		close(fd);
+		return 0;
+	}
+	if( status.st_size % 2 )
+	{
+		snprintf(extents->error, sizeof(extents->error), "%s: odd number of bytes, the last word is cut short", image_path);
+		close(fd);
+		return 0;
+	}
+	uint16_t origin = (uint16_t)(origin_bytes[0] << 8 | origin_bytes[1]);
+	size_t words = ((size_t)status.st_size - 2) / 2;
+	if( !check_image_extent(extents, origin, words, image_path) )
+	{
+		close(fd);
+		return 0;
+	}
+	/* Checked above: the words fit between the origin and the end of memory */
+	ssize_t read = pread(fd, memory + origin, words * sizeof(uint16_t), 2);
+	close(fd);
+	if( read != (ssize_t)(words * sizeof(uint16_t)) )
+	{
+		/* The image is not claimed: a later one may be loaded over what was read */
+		snprintf(extents->error, sizeof(extents->error), "%s: short read", image_path);
+		return 0;
+	}
+	switch_endian_copy(memory + origin, (const uint8_t*)(memory + origin), words);
+	claim_image_extent(extents, origin, words, image_path);
+	return 1;
+}
+
+#endif //LC3_LOAD_IMAGE_H
@@ -4,24 +4,53 @@
 #include "../main_memory.h"
 #include "../memory_mapped_registers.h"
 #include "./check_key.h"
+#include "./live_statistics.h"
+#include "./time_travel.h"
+#include "./performance_counters.h"
+
+/* Host performance counters of the reference engine, enabled with LC3_PERF=1 */
+struct performance_counters perf_counters;
 
 void memory_write(uint16_t address, uint16_t value);
 uint16_t memory_read(uint16_t address);
 
+/*
+    A program spinning on KBSR is waiting for a key, not working: the time between two polls
+    that find no key, with only a few instructions in between, counts as idle for lc3-top
+*/
+static void memory_idle_poll(void) {
+    uint64_t now = statistics_now_ns();
+    uint64_t gap = time_travel.executed - statistics.empty_poll_instruction;
+    if(statistics.empty_poll_ns && gap <= STATISTICS_IDLE_POLL_GAP) {
+        statistics.idle_ns += now - statistics.empty_poll_ns;
+    }
+    statistics.empty_poll_ns = now;
+    statistics.empty_poll_instruction = time_travel.executed;
+}
+
 void memory_write(uint16_t address, uint16_t value) {
     memory[address] = value;    
+    time_travel_mark_dirty(address);
 }
 
 uint16_t memory_read(uint16_t address) {
     /* If we are checking whether a key was pressed on the keyboard */
-    if((address = MMR_KBSR)) {
-        /* Check if file descriptor STDIN_FILENO is ready for readfs operation */
-        if(check_key()) {
+    if(address == MMR_KBSR) {
+        ++statistics.kbsr_polls;
+        /* Check if file descriptor STDIN_FILENO is ready for readfs operation: logged for time travel */
+        int phase = perf_enter(&perf_counters, time_travel.executed, PERF_PHASE_IO);
+        int c = time_travel_poll();
+        perf_leave(&perf_counters, time_travel.executed, phase);
+        if(c >= 0) {
             /* Set the ready bit [15] to 1 */
             memory[MMR_KBSR] = (1 << 15);
             /* Retrieve the character that was pressed */
-            memory[MMR_KBDR] = getchar();
+            memory[MMR_KBDR] = (uint16_t)c;
+            statistics.empty_poll_ns = 0;
         }         
+        else {
+            memory_idle_poll();
+        }
     }
     else {
         /* Need to reset KBSR */
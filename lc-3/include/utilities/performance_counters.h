@@ -0,0 +1,455 @@
+#ifndef LC3_PERFORMANCE_COUNTERS_H
+#define LC3_PERFORMANCE_COUNTERS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+    Host performance counters around the interpreter, enabled with LC3_PERF=1.
+
+    Cycles, instructions, branch misses and L1d read misses of the lc3 process (user space only)
+    are read with perf_event_open() as one group, together with a monotonic clock. Every
+    reading is charged to the current host phase and the current guest region:
+
+        phase:  dispatch (fetch, decode, execute), trap (trap routines), io (console and keyboard),
+                host (between vm_run() calls of a vm.h VM)
+        region: the subroutine being executed, identified by its JSR/JSRR target. RET (JMP R7)
+                returns to the caller's region. The program itself is the region of its entry point.
+
+    Readings are only taken when the phase or region changes. Calls and returns are frequent in
+    some programs, so a reading must not be a syscall: every counter's perf_event page is mapped
+    and read in user space with RDPMC. read() of the group is the fallback, for hosts without
+    RDPMC and for a counter the kernel has not scheduled on a PMU at that moment.
+
+    Each engine instance has its own struct performance_counters, passed to every call with the
+    guest instruction count at that point. The reference engine's are perf_counters, defined in
+    memory_access.h; a struct lc3_vm (vm.h) is counted when its `perf` points at one. Hardware
+    counters count the thread that opened them.
+
+    Every counter is optional: when the host has no PMU (virtual machines, containers) or
+    perf_event_paranoid forbids it the missing counters are reported as unavailable and the
+    clock alone is attributed, giving host nanoseconds rather than cycles per guest instruction.
+*/
+
+#define PERF_MAX_REGIONS 4096
+#define PERF_STACK_DEPTH 256
+/* Regions listed in the report */
+#define PERF_REPORT_REGIONS 16
+
+enum
+{
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_NANOSECONDS,   /* clock_gettime(), always available */
+    PERF_COUNT
+};
+
+enum
+{
+    PERF_PHASE_DISPATCH = 0,
+    PERF_PHASE_TRAP,
+    PERF_PHASE_IO,
+    PERF_PHASE_HOST,    /* outside the engine: the program embedding a vm.h VM */
+    PERF_PHASES
+};
+
+struct perf_region
+{
+    uint16_t address;
+    uint64_t guest_instructions;
+    uint64_t counts[PERF_COUNT];
+};
+
+struct performance_counters
+{
+    int enabled;
+    /* Group leader and members: fds[e] is -1 for a counter the host does not provide */
+    int leader;
+    int fds[PERF_NANOSECONDS];
+    /* Position of each counter in a PERF_FORMAT_GROUP read */
+    int slot[PERF_NANOSECONDS];
+    int open_count;
+    /* perf_event page of each counter, read with RDPMC; NULL when it could not be mapped */
+    struct perf_event_mmap_page* pages[PERF_NANOSECONDS];
+
+    /* Guest instruction count and counters at the last reading */
+    uint64_t last_guest;
+    uint64_t last[PERF_COUNT];
+
+    int phase;
+    int region;
+    uint64_t phases[PERF_PHASES][PERF_COUNT];
+
+    /* Region index per guest address, 0 while the address was never a call target */
+    uint16_t region_of[UINT16_MAX + 1];
+    struct perf_region regions[PERF_MAX_REGIONS];
+    int region_count;
+    int stack[PERF_STACK_DEPTH];
+    int depth;
+};
+
+static const char* perf_counter_names[PERF_COUNT] = { "cycles", "instructions", "branch-misses", "L1d-misses", "ns" };
+static const char* perf_phase_names[PERF_PHASES] = { "dispatch", "trap", "io", "host" };
+
+static uint64_t perf_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int perf_open_counter(uint32_t type, uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t perf_rdpmc(uint32_t counter)
+{
+    uint32_t low, high;
+    __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return (uint64_t)high << 32 | low;
+}
+
+/*
+    Read a counter from its perf_event page, the way the kernel documents it for user space.
+    Returns 0 when it must be read with read() instead.
+*/
+static inline int perf_read_page(const struct perf_event_mmap_page* page, uint64_t* value)
+{
+    uint32_t sequence;
+    do
+    {
+        sequence = page->lock;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        uint32_t index = page->index;
+        if( !page->cap_user_rdpmc || index == 0 )
+        {
+            return 0;
+        }
+        /* The hardware counter is pmc_width bits wide: sign extend it onto the kernel's offset */
+        uint16_t shift = 64 - page->pmc_width;
+        *value = page->offset + (uint64_t)((int64_t)(perf_rdpmc(index - 1) << shift) >> shift);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    } while( page->lock != sequence );
+    return 1;
+}
+#else
+static inline int perf_read_page(const struct perf_event_mmap_page* page, uint64_t* value)
+{
+    (void)page;
+    (void)value;
+    return 0;
+}
+#endif
+
+/* Current value of every open counter: RDPMC when all of them allow it, one read() otherwise */
+static void perf_read_counters(struct performance_counters* perf, uint64_t* now)
+{
+    int mapped = 1;
+    for( int e = 0; e < PERF_NANOSECONDS && mapped; ++e )
+    {
+        if( perf->fds[e] >= 0 )
+        {
+            mapped = perf->pages[e] && perf_read_page(perf->pages[e], &now[e]);
+        }
+    }
+    if( mapped )
+    {
+        return;
+    }
+    uint64_t values[1 + PERF_NANOSECONDS];
+    if( read(perf->leader, values, sizeof(values)) > 0 )
+    {
+        for( int e = 0; e < PERF_NANOSECONDS; ++e )
+        {
+            if( perf->fds[e] >= 0 )
+            {
+                now[e] = values[1 + perf->slot[e]];
+            }
+        }
+    }
+}
+
+/*
+    Take a reading at `guest` instructions, charge it to the current phase and region and switch
+    to the given ones
+*/
+static void perf_switch(struct performance_counters* perf, uint64_t guest, int phase, int region)
+{
+    uint64_t now[PERF_COUNT] = { 0 };
+    if( perf->open_count )
+    {
+        perf_read_counters(perf, now);
+    }
+    now[PERF_NANOSECONDS] = perf_now_ns();
+
+    struct perf_region* current = &perf->regions[perf->region];
+    /* Going back in time (time travel) charges nothing */
+    current->guest_instructions += guest > perf->last_guest ? guest - perf->last_guest : 0;
+    perf->last_guest = guest;
+    for( int e = 0; e < PERF_COUNT; ++e )
+    {
+        uint64_t delta = now[e] - perf->last[e];
+        perf->phases[perf->phase][e] += delta;
+        if( perf->phase != PERF_PHASE_HOST )
+        {
+            current->counts[e] += delta;
+        }
+        perf->last[e] = now[e];
+    }
+    perf->phase = phase;
+    perf->region = region;
+}
+
+/* Enter a phase, returning the one to go back to with perf_leave() */
+static inline int perf_enter(struct performance_counters* perf, uint64_t guest, int phase)
+{
+    int previous = perf->phase;
+    if( perf->enabled && phase != previous )
+    {
+        perf_switch(perf, guest, phase, perf->region);
+    }
+    return previous;
+}
+
+static inline void perf_leave(struct performance_counters* perf, uint64_t guest, int previous)
+{
+    if( perf->enabled && previous != perf->phase )
+    {
+        perf_switch(perf, guest, previous, perf->region);
+    }
+}
+
+static int perf_region_index(struct performance_counters* perf, uint16_t address)
+{
+    int index = perf->region_of[address];
+    if( index == 0 && perf->regions[0].address != address )
+    {
+        if( perf->region_count == PERF_MAX_REGIONS )
+        {
+            /* Table full: charged to the entry region */
+            return 0;
+        }
+        index = perf->region_count++;
+        perf->regions[index].address = address;
+        perf->region_of[address] = (uint16_t)index;
+    }
+    return index;
+}
+
+/* JSR/JSRR to `target` */
+static inline void perf_call(struct performance_counters* perf, uint64_t guest, uint16_t target)
+{
+    if( perf->enabled )
+    {
+        if( perf->depth < PERF_STACK_DEPTH )
+        {
+            perf->stack[perf->depth] = perf->region;
+        }
+        ++perf->depth;
+        perf_switch(perf, guest, perf->phase, perf_region_index(perf, target));
+    }
+}
+
+/* RET: back to the caller's region. Returns without a matching call stay in the current region */
+static inline void perf_return(struct performance_counters* perf, uint64_t guest)
+{
+    if( perf->enabled && perf->depth > 0 )
+    {
+        --perf->depth;
+        if( perf->depth < PERF_STACK_DEPTH )
+        {
+            perf_switch(perf, guest, perf->phase, perf->stack[perf->depth]);
+        }
+    }
+}
+
+static void perf_print_count(const struct performance_counters* perf, uint64_t count, int e)
+{
+    if( e == PERF_NANOSECONDS || perf->fds[e] >= 0 )
+    {
+        fprintf(stderr, " %14llu", (unsigned long long)count);
+    }
+    else
+    {
+        fprintf(stderr, " %14s", "-");
+    }
+}
+
+/* Counter regions are sorted by: cycles when available, time otherwise */
+static int perf_sort_counter;
+
+static int perf_compare_regions(const void* a, const void* b)
+{
+    uint64_t x = ((const struct perf_region*)a)->counts[perf_sort_counter];
+    uint64_t y = ((const struct perf_region*)b)->counts[perf_sort_counter];
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/*
+    Print the counters of the `engine` per phase and per region to stderr, at `guest` instructions.
+    The counters stop: a second report prints nothing.
+*/
+static inline void perf_counters_report(struct performance_counters* perf, const char* engine, uint64_t guest)
+{
+    if( !perf->enabled )
+    {
+        return;
+    }
+    perf_switch(perf, guest, perf->phase, perf->region);
+    perf->enabled = 0;
+
+    int base = perf->fds[PERF_CYCLES] >= 0 ? PERF_CYCLES : PERF_NANOSECONDS;
+    uint64_t guest_total = 0;
+    uint64_t totals[PERF_COUNT] = { 0 };
+    for( int r = 0; r < perf->region_count; ++r )
+    {
+        guest_total += perf->regions[r].guest_instructions;
+    }
+    /* Time outside the engine is listed after the total, not part of it */
+    for( int p = 0; p < PERF_PHASE_HOST; ++p )
+    {
+        for( int e = 0; e < PERF_COUNT; ++e )
+        {
+            totals[e] += perf->phases[p][e];
+        }
+    }
+
+    fprintf(stderr, "\nHost performance counters (%s engine), %llu guest instructions\n%-10s",
+            engine, (unsigned long long)guest_total, "phase");
+    for( int e = 0; e < PERF_COUNT; ++e )
+    {
+        fprintf(stderr, " %14s", perf_counter_names[e]);
+    }
+    fprintf(stderr, "\n");
+    static const int rows[PERF_PHASES + 1] = { PERF_PHASE_DISPATCH, PERF_PHASE_TRAP, PERF_PHASE_IO, -1, PERF_PHASE_HOST };
+    for( int row = 0; row <= PERF_PHASES; ++row )
+    {
+        int p = rows[row];
+        /* Phases the engine never entered are left out */
+        if( p >= 0 && !perf->phases[p][PERF_NANOSECONDS] )
+        {
+            continue;
+        }
+        fprintf(stderr, "%-10s", p >= 0 ? perf_phase_names[p] : "total");
+        for( int e = 0; e < PERF_COUNT; ++e )
+        {
+            perf_print_count(perf, p >= 0 ? perf->phases[p][e] : totals[e], e);
+        }
+        fprintf(stderr, "\n");
+    }
+    if( guest_total )
+    {
+        fprintf(stderr, "%.2f host %s per guest instruction", (double)totals[base] / (double)guest_total, perf_counter_names[base]);
+        if( perf->fds[PERF_INSTRUCTIONS] >= 0 )
+        {
+            fprintf(stderr, ", %.2f host instructions", (double)totals[PERF_INSTRUCTIONS] / (double)guest_total);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    perf_sort_counter = base;
+    qsort(perf->regions, (size_t)perf->region_count, sizeof(struct perf_region), perf_compare_regions);
+    fprintf(stderr, "\n%-10s %14s", "region", "guest-instr");
+    for( int e = 0; e < PERF_COUNT; ++e )
+    {
+        fprintf(stderr, " %14s", perf_counter_names[e]);
+    }
+    fprintf(stderr, " %10s/guest\n", perf_counter_names[base]);
+    for( int r = 0; r < perf->region_count && r < PERF_REPORT_REGIONS; ++r )
+    {
+        const struct perf_region* region = &perf->regions[r];
+        fprintf(stderr, "x%04X      %14llu", region->address, (unsigned long long)region->guest_instructions);
+        for( int e = 0; e < PERF_COUNT; ++e )
+        {
+            perf_print_count(perf, region->counts[e], e);
+        }
+        fprintf(stderr, " %16.2f\n", region->guest_instructions ? (double)region->counts[base] / (double)region->guest_instructions : 0.0);
+    }
+    if( perf->region_count > PERF_REPORT_REGIONS )
+    {
+        fprintf(stderr, "... %d more regions\n", perf->region_count - PERF_REPORT_REGIONS);
+    }
+}
+
+/*
+    Open the counters and start charging to the dispatch phase of the region at `entry`.
+    `perf` must be zeroed. Returns the number of hardware counters available, which may be 0.
+*/
+static inline int perf_counters_open(struct performance_counters* perf, uint16_t entry)
+{
+    static const uint64_t configs[PERF_NANOSECONDS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    static const uint32_t types[PERF_NANOSECONDS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+
+    perf->leader = -1;
+    int error = 0;
+    for( int e = 0; e < PERF_NANOSECONDS; ++e )
+    {
+        perf->fds[e] = perf_open_counter(types[e], configs[e], perf->leader);
+        if( perf->fds[e] < 0 )
+        {
+            error = errno;
+            continue;
+        }
+        if( perf->leader < 0 )
+        {
+            perf->leader = perf->fds[e];
+        }
+        perf->slot[e] = perf->open_count++;
+        /* Readings fall back to read() when the page cannot be mapped */
+        void* page = mmap(NULL, (size_t)sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, perf->fds[e], 0);
+        perf->pages[e] = page == MAP_FAILED ? NULL : page;
+    }
+    if( perf->open_count < PERF_NANOSECONDS )
+    {
+        fprintf(stderr, "lc3: %d of %d hardware counters unavailable (%s)%s\n",
+                PERF_NANOSECONDS - perf->open_count, PERF_NANOSECONDS, strerror(error),
+                perf->open_count ? "" : ", reporting host time only");
+    }
+
+    perf->region_count = 1;
+    perf->regions[0].address = entry;
+    perf->region_of[entry] = 0;
+    perf->enabled = 1;
+    if( perf->leader >= 0 )
+    {
+        ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    /* First reading: nothing is charged before it */
+    perf_switch(perf, 0, PERF_PHASE_DISPATCH, 0);
+    memset(perf->phases, 0, sizeof(perf->phases));
+    memset(perf->regions[0].counts, 0, sizeof(perf->regions[0].counts));
+    perf->regions[0].guest_instructions = 0;
+    return perf->open_count;
+}
+
+#endif //LC3_PERFORMANCE_COUNTERS_H
@@ -11,7 +11,7 @@
     sign_extension: x is the value to be extended, bit_count is the number of bits in the value
 */
 
-uint16_t sign_extension(uint16_t x, int bit_count)
+static inline uint16_t sign_extension(uint16_t x, int bit_count)
 {
     /* if the sign bit is negative  */
     if( (x >> (bit_count-1)) & 1 )
@@ -1,16 +1,60 @@
 #ifndef LC3_SWITCH_ENDIAN_H
 #define LC3_SWITCH_ENDIAN_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /* 
     Endianness refers to how bytes are interpreted.
     Big-endian: Most significant byte in the smallest memory address, least significant byte in the largest memory address: that is the most significant value in the sequence is stored first.
     Little-endian: Least significant byte in the smallest memory address, most significant byte in the largest memory address: that is the least significant byte is stored first.
 */
-uint16_t switch_endian(uint16_t x)
+static inline uint16_t switch_endian(uint16_t x)
 {
 	return ( x << 8 | x >> 8 );
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+/* 32 bytes per PSHUFB: swap the two bytes of every word */
+__attribute__((target("avx2")))
+static void switch_endian_copy_avx2(uint16_t* destination, const uint8_t* source, size_t words)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for( ; i + 16 <= words; i += 16 )
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(source + 2 * i));
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_shuffle_epi8(v, swap));
+    }
+    for( ; i < words; ++i )
+    {
+        destination[i] = (uint16_t)(source[2 * i] << 8 | source[2 * i + 1]);
+    }
+}
+#endif
+
+/*
+    Copy `words` big endian words from a byte buffer into host order.
+    The source needs no alignment and may be the destination itself, to swap in place.
+*/
+static void switch_endian_copy(uint16_t* destination, const uint8_t* source, size_t words)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if( __builtin_cpu_supports("avx2") )
+    {
+        switch_endian_copy_avx2(destination, source, words);
+        return;
+    }
+#endif
+    for( size_t i = 0; i < words; ++i )
+    {
+        destination[i] = (uint16_t)(source[2 * i] << 8 | source[2 * i + 1]);
+    }
+}
+
 #endif //LC3_SWITCH_ENDIAN_H
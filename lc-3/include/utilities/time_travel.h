@@ -0,0 +1,592 @@
+#ifndef LC3_TIME_TRAVEL_H
+#define LC3_TIME_TRAVEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "../main_memory.h"
+#include "../registers.h"
+#include "./check_key.h"
+#include "./terminal_io.h"
+
+/*
+    Time travel: periodic incremental checkpoints of the VM plus a log of the input it consumed.
+
+    Every `interval` instructions the registers and the pages of memory[] written since the previous
+    checkpoint are saved. The oldest checkpoint keeps a full copy of memory (the base), so the state
+    at any checkpoint is the base with the page deltas of the later checkpoints applied in order.
+    When the checkpoints outgrow `memory_limit` the oldest delta is folded into the base.
+
+    Input is logged as it is consumed (GETC, IN and KBSR polls) so that re-execution from a checkpoint
+    sees exactly the input the original run saw. Output is suppressed while re-executing instructions
+    that already ran once.
+
+    Going to instruction K restores the last checkpoint at or before K and re-executes forward to K.
+*/
+
+#define TIME_TRAVEL_PAGE_SHIFT 8
+#define TIME_TRAVEL_PAGE_WORDS (1 << TIME_TRAVEL_PAGE_SHIFT)
+#define TIME_TRAVEL_PAGES ((UINT16_MAX + 1) / TIME_TRAVEL_PAGE_WORDS)
+/* The device page holds KBSR/KBDR, which memory_read() updates without going through memory_write() */
+#define TIME_TRAVEL_DEVICE_PAGE (0xFE00 >> TIME_TRAVEL_PAGE_SHIFT)
+
+#define TIME_TRAVEL_DEFAULT_INTERVAL 1000000
+#define TIME_TRAVEL_DEFAULT_MEMORY_MB 32
+
+struct checkpoint
+{
+    uint64_t executed;
+    uint16_t registers[R_COUNT];
+    /* Input log entries consumed before this checkpoint, and KBSR polls replayed from the next one */
+    uint64_t log_position;
+    uint64_t replayed_polls;
+    /* Pages written since the previous checkpoint, with their contents at this checkpoint */
+    uint16_t page_count;
+    uint8_t* pages;
+    uint16_t* page_data;
+};
+
+/*
+    One input byte as seen by the guest: `idle_polls` KBSR polls that found no key, then the byte.
+    The last entry may be incomplete (character < 0): polls found no key and nothing arrived yet.
+*/
+struct input_event
+{
+    /* 64 bits: programs waiting for a key poll KBSR millions of times a second */
+    uint64_t idle_polls;
+    int32_t character;
+};
+
+struct time_travel
+{
+    int enabled;
+    uint64_t interval;
+    size_t memory_limit;
+    /* Base plus page deltas plus the input log */
+    size_t memory_used;
+
+    /* Instructions executed so far, including the one being executed */
+    uint64_t executed;
+    /* Next point at which time_travel_event() must run: a checkpoint or a requested stop */
+    uint64_t next_event;
+    uint64_t next_checkpoint;
+    uint64_t stop_at;
+    /* Furthest instruction executed: instructions up to it are being re-executed */
+    uint64_t horizon;
+
+    /* Full copy of memory at checkpoints[0] */
+    uint16_t* base;
+    struct checkpoint* checkpoints;
+    size_t checkpoint_count;
+    size_t checkpoint_capacity;
+
+    uint8_t dirty[TIME_TRAVEL_PAGES];
+
+    struct input_event* log;
+    /* log[0] is entry number log_first of the whole run */
+    uint64_t log_first;
+    uint64_t log_length;
+    size_t log_capacity;
+    /* Entry being consumed */
+    uint64_t log_position;
+    /* KBSR polls already replayed from the entry at log_position */
+    uint64_t replayed_polls;
+
+    /* Set by SIGQUIT: open the debugger at the next checkpoint */
+    volatile sig_atomic_t break_requested;
+};
+
+/* Disabled until time_travel_init(): no event is ever due */
+struct time_travel time_travel = { .next_event = UINT64_MAX, .next_checkpoint = UINT64_MAX };
+
+void time_travel_debugger(const char* reason);
+
+static inline void time_travel_mark_dirty(uint16_t address)
+{
+    time_travel.dirty[address >> TIME_TRAVEL_PAGE_SHIFT] = 1;
+}
+
+static inline int time_travel_replaying(void)
+{
+    return time_travel.executed <= time_travel.horizon;
+}
+
+static void time_travel_schedule(void)
+{
+    time_travel.next_event = time_travel.next_checkpoint;
+    if( time_travel.stop_at && time_travel.stop_at < time_travel.next_event )
+    {
+        time_travel.next_event = time_travel.stop_at;
+    }
+}
+
+static inline size_t checkpoint_size(const struct checkpoint* c)
+{
+    return c->page_count * (1 + TIME_TRAVEL_PAGE_WORDS * sizeof(uint16_t));
+}
+
+/* Release the page delta of a checkpoint */
+static void checkpoint_free(struct checkpoint* c)
+{
+    time_travel.memory_used -= checkpoint_size(c);
+    free(c->pages);
+    free(c->page_data);
+    c->page_count = 0;
+    c->pages = NULL;
+    c->page_data = NULL;
+}
+
+/* Fold checkpoints[1] into the base and forget checkpoints[0] */
+static void time_travel_drop_oldest(void)
+{
+    struct checkpoint* second = &time_travel.checkpoints[1];
+    for( int i = 0; i < second->page_count; ++i )
+    {
+        int page = second->pages[i];
+        memcpy(time_travel.base + page * TIME_TRAVEL_PAGE_WORDS, second->page_data + i * TIME_TRAVEL_PAGE_WORDS,
+               TIME_TRAVEL_PAGE_WORDS * sizeof(uint16_t));
+    }
+    /* The base now holds the full state at the second checkpoint, which becomes the oldest */
+    checkpoint_free(&time_travel.checkpoints[0]);
+    checkpoint_free(second);
+    memmove(time_travel.checkpoints, time_travel.checkpoints + 1, (time_travel.checkpoint_count - 1) * sizeof(struct checkpoint));
+    --time_travel.checkpoint_count;
+
+    /* Input consumed before the oldest checkpoint can never be replayed again */
+    uint64_t keep_from = time_travel.checkpoints[0].log_position;
+    uint64_t drop = keep_from - time_travel.log_first;
+    if( drop > time_travel.log_length / 2 )
+    {
+        memmove(time_travel.log, time_travel.log + drop, (time_travel.log_length - drop) * sizeof(struct input_event));
+        time_travel.log_length -= drop;
+        time_travel.log_first = keep_from;
+    }
+}
+
+static void time_travel_checkpoint(void)
+{
+    if( time_travel.checkpoint_count == time_travel.checkpoint_capacity )
+    {
+        size_t capacity = time_travel.checkpoint_capacity ? time_travel.checkpoint_capacity * 2 : 64;
+        struct checkpoint* checkpoints = realloc(time_travel.checkpoints, capacity * sizeof(struct checkpoint));
+        if( !checkpoints )
+        {
+            return;
+        }
+        time_travel.checkpoints = checkpoints;
+        time_travel.checkpoint_capacity = capacity;
+    }
+
+    struct checkpoint* c = &time_travel.checkpoints[time_travel.checkpoint_count];
+    c->executed = time_travel.executed;
+    memcpy(c->registers, registers, sizeof(registers));
+    c->log_position = time_travel.log_position;
+    c->replayed_polls = time_travel.replayed_polls;
+    c->page_count = 0;
+    c->pages = NULL;
+    c->page_data = NULL;
+
+    time_travel.dirty[TIME_TRAVEL_DEVICE_PAGE] = 1;
+    int dirty_pages = 0;
+    for( int page = 0; page < TIME_TRAVEL_PAGES; ++page )
+    {
+        dirty_pages += time_travel.dirty[page];
+    }
+    c->pages = malloc(dirty_pages);
+    c->page_data = malloc((size_t)dirty_pages * TIME_TRAVEL_PAGE_WORDS * sizeof(uint16_t));
+    if( !c->pages || !c->page_data )
+    {
+        free(c->pages);
+        free(c->page_data);
+        return;
+    }
+    for( int page = 0; page < TIME_TRAVEL_PAGES; ++page )
+    {
+        if( time_travel.dirty[page] )
+        {
+            c->pages[c->page_count] = (uint8_t)page;
+            memcpy(c->page_data + c->page_count * TIME_TRAVEL_PAGE_WORDS, memory + page * TIME_TRAVEL_PAGE_WORDS,
+                   TIME_TRAVEL_PAGE_WORDS * sizeof(uint16_t));
+            ++c->page_count;
+        }
+    }
+    memset(time_travel.dirty, 0, sizeof(time_travel.dirty));
+    time_travel.memory_used += checkpoint_size(c);
+    ++time_travel.checkpoint_count;
+
+    while( time_travel.memory_used > time_travel.memory_limit && time_travel.checkpoint_count > 2 )
+    {
+        time_travel_drop_oldest();
+    }
+}
+
+/* Enable time travel. Call once the images are loaded: the first checkpoint is taken immediately */
+void time_travel_init(uint64_t interval, size_t memory_limit)
+{
+    if( interval == 0 )
+    {
+        return;
+    }
+    time_travel.base = malloc(sizeof(memory));
+    if( !time_travel.base )
+    {
+        return;
+    }
+    memcpy(time_travel.base, memory, sizeof(memory));
+    time_travel.enabled = 1;
+    time_travel.interval = interval;
+    time_travel.memory_limit = memory_limit;
+    time_travel.memory_used = sizeof(memory);
+
+    /* Checkpoint 0 is the base: its delta is never applied */
+    time_travel_checkpoint();
+
+    time_travel.next_checkpoint = interval;
+    time_travel_schedule();
+}
+
+/* Restore the last checkpoint at or before `target` and arrange to stop at `target` */
+static void time_travel_goto(uint64_t target)
+{
+    size_t k = time_travel.checkpoint_count;
+    while( k > 1 && time_travel.checkpoints[k - 1].executed > target )
+    {
+        --k;
+    }
+    struct checkpoint* c = &time_travel.checkpoints[k - 1];
+    if( c->executed > target )
+    {
+        printf("Instruction %llu is before the oldest checkpoint (%llu)\n",
+               (unsigned long long)target, (unsigned long long)c->executed);
+        target = c->executed;
+    }
+
+    if( time_travel.executed > time_travel.horizon )
+    {
+        time_travel.horizon = time_travel.executed;
+    }
+
+    memcpy(memory, time_travel.base, sizeof(memory));
+    for( size_t i = 1; i < k; ++i )
+    {
+        struct checkpoint* delta = &time_travel.checkpoints[i];
+        for( int p = 0; p < delta->page_count; ++p )
+        {
+            int page = delta->pages[p];
+            memcpy(memory + page * TIME_TRAVEL_PAGE_WORDS, delta->page_data + p * TIME_TRAVEL_PAGE_WORDS,
+                   TIME_TRAVEL_PAGE_WORDS * sizeof(uint16_t));
+        }
+    }
+    memcpy(registers, c->registers, sizeof(registers));
+    time_travel.executed = c->executed;
+    time_travel.log_position = c->log_position;
+    /* A checkpoint taken while the program waited for a key replays the rest of the wait only */
+    time_travel.replayed_polls = c->replayed_polls;
+
+    /* Later checkpoints are taken again on the way forward */
+    while( time_travel.checkpoint_count > k )
+    {
+        checkpoint_free(&time_travel.checkpoints[--time_travel.checkpoint_count]);
+    }
+    memset(time_travel.dirty, 0, sizeof(time_travel.dirty));
+    time_travel.next_checkpoint = c->executed + time_travel.interval;
+    time_travel.stop_at = target;
+    time_travel_schedule();
+}
+
+/* Called by the interpreter when `executed` reaches `next_event` */
+void time_travel_event(void)
+{
+    if( time_travel.executed == time_travel.next_checkpoint )
+    {
+        time_travel_checkpoint();
+        time_travel.next_checkpoint += time_travel.interval;
+        if( time_travel.break_requested )
+        {
+            time_travel.break_requested = 0;
+            time_travel.stop_at = time_travel.executed;
+        }
+    }
+    if( time_travel.executed == time_travel.stop_at )
+    {
+        time_travel.stop_at = 0;
+        time_travel_schedule();
+        time_travel_debugger(NULL);
+    }
+    time_travel_schedule();
+}
+
+static struct input_event* time_travel_log_entry(uint64_t position)
+{
+    if( position == time_travel.log_first + time_travel.log_length )
+    {
+        if( time_travel.log_length == time_travel.log_capacity )
+        {
+            size_t capacity = time_travel.log_capacity ? time_travel.log_capacity * 2 : 1024;
+            struct input_event* log = realloc(time_travel.log, capacity * sizeof(struct input_event));
+            if( !log )
+            {
+                return NULL;
+            }
+            time_travel.log = log;
+            time_travel.memory_used += (capacity - time_travel.log_capacity) * sizeof(struct input_event);
+            time_travel.log_capacity = capacity;
+        }
+        struct input_event* entry = &time_travel.log[time_travel.log_length++];
+        entry->idle_polls = 0;
+        entry->character = -1;
+    }
+    return &time_travel.log[position - time_travel.log_first];
+}
+
+/* Blocking read of one character (GETC, IN) */
+int time_travel_getc(void)
+{
+    if( !time_travel.enabled )
+    {
+        return getchar();
+    }
+    struct input_event* entry = time_travel_log_entry(time_travel.log_position);
+    if( !entry )
+    {
+        return getchar();
+    }
+    if( entry->character < 0 )
+    {
+        entry->character = getchar();
+    }
+    ++time_travel.log_position;
+    time_travel.replayed_polls = 0;
+    return entry->character;
+}
+
+/* Non blocking poll of the keyboard (KBSR). Returns the character or -1 if no key is available */
+int time_travel_poll(void)
+{
+    if( !time_travel.enabled )
+    {
+        return check_key() ? getchar() : -1;
+    }
+    struct input_event* entry = time_travel_log_entry(time_travel.log_position);
+    if( !entry )
+    {
+        return check_key() ? getchar() : -1;
+    }
+    if( time_travel.replayed_polls < entry->idle_polls )
+    {
+        /* Re-executing a poll that found no key */
+        ++time_travel.replayed_polls;
+        return -1;
+    }
+    if( entry->character < 0 )
+    {
+        if( !check_key() )
+        {
+            ++entry->idle_polls;
+            ++time_travel.replayed_polls;
+            return -1;
+        }
+        entry->character = getchar();
+    }
+    ++time_travel.log_position;
+    time_travel.replayed_polls = 0;
+    return entry->character;
+}
+
+static void time_travel_show_registers(void)
+{
+    printf("instruction %llu  PC=x%04X  COND=%s\n", (unsigned long long)time_travel.executed, registers[R_PC],
+           registers[R_COND] == FL_NEG ? "N" : registers[R_COND] == FL_ZER ? "Z" : "P");
+    for( int r = R_R0; r <= R_R7; ++r )
+    {
+        printf("R%d=x%04X%s", r, registers[r], r == R_R7 ? "\n" : "  ");
+    }
+    printf("next: x%04X\n", memory[registers[R_PC]]);
+}
+
+/*
+    Parse a number typed at the debugger: decimal, #decimal, or hex as x3000 (as printed by the
+    debugger) or 0x3000. Returns 1 on SUCCESS, 0 if `text` is not a number.
+*/
+static int time_travel_parse_number(const char* text, uint64_t* value)
+{
+    int base = 10;
+    if( *text == 'x' || *text == 'X' )
+    {
+        base = 16;
+        ++text;
+    }
+    else if( *text == '#' )
+    {
+        ++text;
+    }
+    else if( text[0] == '0' && (text[1] == 'x' || text[1] == 'X') )
+    {
+        base = 16;
+        text += 2;
+    }
+    if( !isxdigit((unsigned char)*text) )
+    {
+        return 0;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, base);
+    if( *end != '\0' || errno )
+    {
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+/*
+    Interactive prompt on the terminal. Returns to the interpreter to run forward, after arranging
+    with time_travel_goto() where to stop next, or to carry on live.
+*/
+void time_travel_debugger(const char* reason)
+{
+    restore_input_buffering();
+    if( reason )
+    {
+        printf("\n%s at instruction %llu\n", reason, (unsigned long long)time_travel.executed);
+    }
+    time_travel_show_registers();
+
+    char line[128];
+    for(;;)
+    {
+        printf("(lc3) ");
+        fflush(stdout);
+        if( !fgets(line, sizeof(line), stdin) )
+        {
+            exit(1);
+        }
+        char command[16] = "";
+        char first[32] = "";
+        char second[32] = "";
+        int fields = sscanf(line, "%15s %31s %31s", command, first, second);
+        uint64_t argument = 0;
+        uint64_t count = 0;
+        const char* bad = NULL;
+        if( fields >= 2 && !time_travel_parse_number(first, &argument) )
+        {
+            bad = first;
+        }
+        else if( fields >= 3 && !time_travel_parse_number(second, &count) )
+        {
+            bad = second;
+        }
+        if( bad )
+        {
+            printf("Not a number: %s\n", bad);
+            continue;
+        }
+
+        if( fields < 1 || strcmp(command, "regs") == 0 )
+        {
+            time_travel_show_registers();
+        }
+        else if( strcmp(command, "back") == 0 || strcmp(command, "step") == 0 || strcmp(command, "goto") == 0 )
+        {
+            uint64_t target;
+            if( strcmp(command, "goto") == 0 )
+            {
+                if( fields < 2 )
+                {
+                    printf("goto needs an instruction number\n");
+                    continue;
+                }
+                target = argument;
+            }
+            else
+            {
+                uint64_t distance = fields >= 2 ? argument : 1;
+                target = command[0] == 'b'
+                    ? (distance > time_travel.executed ? 0 : time_travel.executed - distance)
+                    : time_travel.executed + distance;
+            }
+            if( target < time_travel.executed || target == 0 )
+            {
+                time_travel_goto(target);
+            }
+            else
+            {
+                time_travel.stop_at = target;
+                time_travel_schedule();
+            }
+            if( time_travel.executed == time_travel.stop_at )
+            {
+                /* Landed exactly on a checkpoint */
+                time_travel.stop_at = 0;
+                time_travel_schedule();
+                time_travel_show_registers();
+                continue;
+            }
+            break;
+        }
+        else if( strcmp(command, "mem") == 0 )
+        {
+            if( fields < 2 || argument > UINT16_MAX )
+            {
+                printf("mem needs an address from x0000 to xFFFF\n");
+                continue;
+            }
+            uint16_t address = (uint16_t)argument;
+            count = fields >= 3 && count ? count : 8;
+            for( uint64_t i = 0; i < count && i <= UINT16_MAX; ++i, ++address )
+            {
+                printf("%sx%04X", i % 8 ? " " : (i ? "\n" : ""), memory[address]);
+            }
+            printf("\n");
+        }
+        else if( strcmp(command, "checkpoints") == 0 )
+        {
+            printf("%zu checkpoints from instruction %llu, %zu KB\n", time_travel.checkpoint_count,
+                   (unsigned long long)time_travel.checkpoints[0].executed, time_travel.memory_used / 1024);
+        }
+        else if( strcmp(command, "continue") == 0 )
+        {
+            break;
+        }
+        else if( strcmp(command, "quit") == 0 )
+        {
+            exit(1);
+        }
+        else
+        {
+            printf("regs | back [n] | step [n] | goto K | mem ADDR [count] | checkpoints | continue | quit\n");
+        }
+    }
+    disable_input_buffering();
+}
+
+/*
+    Rewind to just before the instruction being executed and open the debugger there.
+    Used instead of abort() when the guest crashes.
+*/
+void time_travel_break(const char* reason)
+{
+    printf("\n%s at instruction %llu, rewinding\n", reason, (unsigned long long)time_travel.executed);
+    time_travel_goto(time_travel.executed - 1);
+    if( time_travel.executed == time_travel.stop_at )
+    {
+        time_travel.stop_at = 0;
+        time_travel_schedule();
+        time_travel_debugger(NULL);
+    }
+}
+
+/* SIGQUIT (Ctrl-\): open the debugger at the next checkpoint */
+void time_travel_handle_break(int signal)
+{
+    (void)signal;
+    time_travel.break_requested = 1;
+}
+
+#endif //LC3_TIME_TRAVEL_H
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Library API */
+#include "./include/lc3vm.h"
+
+/* Execution engines */
+#include "./include/engines/vm.h"
+
+/*
+    liblc3vm: include/lc3vm.h on top of struct lc3_vm.
+
+    Built with -fvisibility=hidden: only the LC3VM_API functions are exported. vm_run() is
+    compiled in this unit with its memory access and flag helpers inlined, so embedding costs
+    a call per slice, not per instruction.
+*/
+
+/* The public constants are the engine's own */
+_Static_assert((int)LC3VM_STOP_HOST == (int)VM_STOP_HOST && (int)LC3VM_STOP_INPUT == (int)VM_STOP_INPUT &&
+               (int)LC3VM_STOP_BAD_OPCODE == (int)VM_STOP_BAD_OPCODE && (int)LC3VM_STOP_HALT == (int)VM_STOP_HALT,
+               "stop reasons differ from vm.h");
+_Static_assert((int)LC3VM_TRAP_HANDLED == (int)VM_TRAP_HANDLED && (int)LC3VM_TRAP_STOP == (int)VM_TRAP_STOP,
+               "trap actions differ from vm.h");
+_Static_assert((int)LC3VM_R7 == (int)R_R7 && (int)LC3VM_PC == (int)R_PC && (int)LC3VM_COND == (int)R_COND,
+               "register numbers differ from register_numbers.h");
+
+LC3VM_API struct lc3_vm* lc3vm_create(void)
+{
+    struct lc3_vm* vm = calloc(1, sizeof(struct lc3_vm));
+    if( vm )
+    {
+        vm_reset_registers(vm);
+    }
+    return vm;
+}
+
+LC3VM_API void lc3vm_destroy(struct lc3_vm* vm)
+{
+    free(vm);
+}
+
+LC3VM_API int lc3vm_load_image(struct lc3_vm* vm, const void* image, size_t length)
+{
+    return vm_load_image(vm, image, length);
+}
+
+LC3VM_API const char* lc3vm_load_error(const struct lc3_vm* vm)
+{
+    return vm_load_error(vm);
+}
+
+LC3VM_API void lc3vm_reset(struct lc3_vm* vm)
+{
+    vm_reset_registers(vm);
+}
+
+LC3VM_API void lc3vm_set_callbacks(struct lc3_vm* vm, const struct lc3vm_callbacks* callbacks, void* context)
+{
+    vm->input = callbacks ? callbacks->input : NULL;
+    vm->output = callbacks ? callbacks->output : NULL;
+    vm->trap = callbacks ? callbacks->trap : NULL;
+    vm->device_read = callbacks ? callbacks->device_read : NULL;
+    vm->device_write = callbacks ? callbacks->device_write : NULL;
+    vm->context = context;
+}
+
+LC3VM_API void lc3vm_set_stop_on_idle_poll(struct lc3_vm* vm, int enabled)
+{
+    vm->stop_on_idle_poll = enabled;
+}
+
+LC3VM_API void lc3vm_set_delay_loop_elision(struct lc3_vm* vm, int enabled)
+{
+    vm->elide_delay_loops = enabled;
+}
+
+LC3VM_API int lc3vm_run(struct lc3_vm* vm, uint64_t max_instructions)
+{
+    return vm_run(vm, max_instructions);
+}
+
+LC3VM_API uint64_t lc3vm_retired(const struct lc3_vm* vm)
+{
+    return vm->retired;
+}
+
+LC3VM_API uint64_t lc3vm_elided(const struct lc3_vm* vm)
+{
+    return vm->elided;
+}
+
+LC3VM_API uint16_t lc3vm_get_register(const struct lc3_vm* vm, int r)
+{
+    return r >= 0 && r < R_COUNT ? vm->registers[r] : 0;
+}
+
+LC3VM_API void lc3vm_set_register(struct lc3_vm* vm, int r, uint16_t value)
+{
+    if( r >= 0 && r < R_COUNT )
+    {
+        vm->registers[r] = value;
+    }
+}
+
+LC3VM_API uint16_t lc3vm_read_memory(const struct lc3_vm* vm, uint16_t address)
+{
+    return vm->memory[address];
+}
+
+LC3VM_API void lc3vm_write_memory(struct lc3_vm* vm, uint16_t address, uint16_t value)
+{
+    vm->memory[address] = value;
+    vm_mark_dirty(vm, address);
+}
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+/* nix headers */
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Execution engines */
+#include "./include/engines/vm.h"
+#include "./include/engines/session.h"
+
+/*
+    lc3-server: host many interactive VMs in one process.
+
+    One I/O thread owns the epoll loop: it accepts sessions, reads their input into the
+    per-session input rings and flushes output the sockets could not take at once.
+    A pool of workers runs the runnable VMs a quantum at a time. A VM waiting for input
+    (GETC, IN or an empty KBSR poll) is parked off the run queue and costs nothing until
+    the I/O thread delivers input for it.
+
+    Sessions are only ever freed by the I/O thread, after the events of the current
+    epoll_wait() batch have been handled, so no event can refer to a freed session.
+
+    Guests may pace themselves with delay loops, so those are only run in closed form on
+    request (LC3_DELAY_LOOPS=1, see include/utilities/delay_loops.h).
+*/
+
+#define SERVER_QUANTUM 100000
+#define SERVER_MAX_EVENTS 256
+
+static struct lc3_vm template_vm;
+
+static int epoll_fd;
+static int listen_fd;
+/* Wakes the I/O thread when a worker retires a session */
+static int reap_fd;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static struct session* queue_head;
+static struct session* queue_tail;
+static struct session* reap_list;
+
+static long sessions_open;
+
+static void server_usage(void)
+{
+    printf("lc3-server [-w workers] (-u socket-path | -p port) [image-file] ...\n");
+    exit(2);
+}
+
+static void enqueue(struct session* s)
+{
+    pthread_mutex_lock(&queue_lock);
+    s->next = NULL;
+    if( queue_tail )
+    {
+        queue_tail->next = s;
+    }
+    else
+    {
+        queue_head = s;
+    }
+    queue_tail = s;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static struct session* dequeue(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    while( !queue_head )
+    {
+        pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+    struct session* s = queue_head;
+    queue_head = s->next;
+    if( !queue_head )
+    {
+        queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return s;
+}
+
+/* Hand a parked, closing session to the I/O thread. Called with s->lock held */
+static void retire(struct session* s)
+{
+    if( s->retired )
+    {
+        return;
+    }
+    s->retired = 1;
+    pthread_mutex_lock(&queue_lock);
+    s->next = reap_list;
+    reap_list = s;
+    pthread_mutex_unlock(&queue_lock);
+    uint64_t one = 1;
+    if( write(reap_fd, &one, sizeof(one)) < 0 )
+    {
+        /* The counter can only overflow after 2^64 writes: nothing to do */
+    }
+}
+
+/* Free retired sessions. I/O thread only */
+static void reap(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    struct session* s = reap_list;
+    reap_list = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    while(s)
+    {
+        struct session* next = s->next;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+        close(s->fd);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+        --sessions_open;
+        s = next;
+    }
+}
+
+/* Send buffered output until the socket is full. Called with s->lock held */
+static void flush_output(struct session* s)
+{
+    size_t sent = 0;
+    while( sent < s->output_length )
+    {
+        ssize_t n = send(s->fd, s->output + sent, s->output_length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if( n <= 0 )
+        {
+            break;
+        }
+        sent += (size_t)n;
+    }
+    memmove(s->output, s->output + sent, s->output_length - sent);
+    s->output_length -= sent;
+}
+
+/* struct lc3_vm output hook: runs on a worker */
+static void session_output(void* context, const uint8_t* bytes, size_t length)
+{
+    struct session* s = context;
+    pthread_mutex_lock(&s->lock);
+    size_t space = SESSION_OUTPUT_SIZE - s->output_length;
+    /* A client that stops reading loses output rather than stalling a worker */
+    if( length > space )
+    {
+        length = space;
+    }
+    memcpy(s->output + s->output_length, bytes, length);
+    s->output_length += length;
+    flush_output(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* struct lc3_vm input hook: runs on a worker */
+static int session_input(void* context)
+{
+    struct session* s = context;
+    return input_ring_pop(&s->input);
+}
+
+static void* worker(void* argument)
+{
+    (void)argument;
+    for(;;)
+    {
+        struct session* s = dequeue();
+
+        pthread_mutex_lock(&s->lock);
+        if( s->closing )
+        {
+            s->state = SESSION_PARKED;
+            retire(s);
+            pthread_mutex_unlock(&s->lock);
+            continue;
+        }
+        s->state = SESSION_RUNNING;
+        pthread_mutex_unlock(&s->lock);
+
+        int stop = vm_run(&s->vm, SERVER_QUANTUM);
+
+        if( stop == VM_STOP_BAD_OPCODE )
+        {
+            static const char message[] = "Bad opcode, Aborting...\n";
+            session_output(s, (const uint8_t*)message, sizeof(message) - 1);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        int requeue = 0;
+        if( stop == VM_STOP_HALT || stop == VM_STOP_BAD_OPCODE )
+        {
+            s->closing = 1;
+        }
+        else if( stop == VM_STOP_LIMIT )
+        {
+            requeue = !s->closing;
+        }
+        else if( !input_ring_empty(&s->input) )
+        {
+            /* Input arrived while the VM was stopping */
+            requeue = !s->closing;
+        }
+        else if( s->input_closed )
+        {
+            s->closing = 1;
+        }
+
+        if( requeue )
+        {
+            s->state = SESSION_QUEUED;
+            pthread_mutex_unlock(&s->lock);
+            enqueue(s);
+            continue;
+        }
+        s->state = SESSION_PARKED;
+        if( s->closing )
+        {
+            retire(s);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+static void accept_sessions(void)
+{
+    for(;;)
+    {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if( fd < 0 )
+        {
+            return;
+        }
+        struct session* s = malloc(sizeof(struct session));
+        if( !s )
+        {
+            close(fd);
+            continue;
+        }
+        memcpy(&s->vm, &template_vm, sizeof(template_vm));
+        s->vm.input = session_input;
+        s->vm.output = session_output;
+        s->vm.context = s;
+        s->vm.stop_on_idle_poll = 1;
+        vm_reset_registers(&s->vm);
+        s->fd = fd;
+        pthread_mutex_init(&s->lock, NULL);
+        s->state = SESSION_QUEUED;
+        s->input_closed = 0;
+        s->closing = 0;
+        s->retired = 0;
+        s->output_length = 0;
+        atomic_init(&s->input.head, 0);
+        atomic_init(&s->input.tail, 0);
+
+        /* Edge triggered: every event is handled until EAGAIN */
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = s };
+        if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 )
+        {
+            close(fd);
+            free(s);
+            continue;
+        }
+        ++sessions_open;
+        enqueue(s);
+    }
+}
+
+static void handle_session_event(struct session* s, uint32_t events)
+{
+    if( events & EPOLLIN )
+    {
+        uint8_t buffer[SESSION_INPUT_SIZE];
+        ssize_t n;
+        while( (n = read(s->fd, buffer, sizeof(buffer))) > 0 )
+        {
+            /* Keystrokes beyond a full ring are dropped: the guest is not reading them */
+            input_ring_push(&s->input, buffer, (size_t)n);
+        }
+        if( n == 0 )
+        {
+            events |= EPOLLRDHUP;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if( events & (EPOLLHUP | EPOLLERR) )
+    {
+        s->closing = 1;
+    }
+    if( events & EPOLLRDHUP )
+    {
+        s->input_closed = 1;
+    }
+    if( events & EPOLLOUT )
+    {
+        flush_output(s);
+    }
+    if( s->state == SESSION_PARKED && !s->retired )
+    {
+        if( s->closing || (s->input_closed && input_ring_empty(&s->input)) )
+        {
+            s->closing = 1;
+            retire(s);
+        }
+        else if( !input_ring_empty(&s->input) )
+        {
+            s->state = SESSION_QUEUED;
+            pthread_mutex_unlock(&s->lock);
+            enqueue(s);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int listen_unix(const char* path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if( fd < 0 || strlen(path) >= sizeof(address.sun_path) )
+    {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if( bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 )
+    {
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    /* Local only: sessions are unauthenticated */
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if( bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 )
+    {
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv)
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* socket_path = NULL;
+    int port = 0;
+    int i = 1;
+    for( ; i + 1 < argc && argv[i][0] == '-'; i += 2 )
+    {
+        if( strcmp(argv[i], "-w") == 0 )
+        {
+            workers = strtol(argv[i + 1], NULL, 0);
+        }
+        else if( strcmp(argv[i], "-u") == 0 )
+        {
+            socket_path = argv[i + 1];
+        }
+        else if( strcmp(argv[i], "-p") == 0 )
+        {
+            port = (int)strtol(argv[i + 1], NULL, 0);
+        }
+        else
+        {
+            server_usage();
+        }
+    }
+    if( i == argc || (!socket_path && !port) || workers < 1 )
+    {
+        server_usage();
+    }
+    for( ; i < argc; ++i )
+    {
+        if( !vm_load_image_file(&template_vm, argv[i]) )
+        {
+            printf("Failed to load image: %s\n", vm_load_error(&template_vm));
+            exit(1);
+        }
+    }
+    /* Every session copies the template */
+    const char* elide = getenv("LC3_DELAY_LOOPS");
+    template_vm.elide_delay_loops = elide && strcmp(elide, "0") != 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket_path ? listen_unix(socket_path) : listen_tcp(port);
+    if( listen_fd < 0 || listen(listen_fd, SOMAXCONN) < 0 )
+    {
+        printf("Failed to listen: %s\n", strerror(errno));
+        exit(1);
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reap_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( epoll_fd < 0 || reap_fd < 0 )
+    {
+        printf("Failed to set up epoll: %s\n", strerror(errno));
+        exit(1);
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listen_fd };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.ptr = &reap_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reap_fd, &event);
+
+    for( long w = 0; w < workers; ++w )
+    {
+        pthread_t thread;
+        if( pthread_create(&thread, NULL, worker, NULL) != 0 )
+        {
+            printf("Failed to start worker\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    if( socket_path )
+    {
+        printf("Serving on %s with %ld workers\n", socket_path, workers);
+    }
+    else
+    {
+        printf("Serving on 127.0.0.1:%d with %ld workers\n", port, workers);
+    }
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    for(;;)
+    {
+        int n = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        for( int e = 0; e < n; ++e )
+        {
+            if( events[e].data.ptr == &listen_fd )
+            {
+                accept_sessions();
+            }
+            else if( events[e].data.ptr == &reap_fd )
+            {
+                uint64_t count;
+                if( read(reap_fd, &count, sizeof(count)) < 0 )
+                {
+                    /* Already drained */
+                }
+            }
+            else
+            {
+                handle_session_event(events[e].data.ptr, events[e].events);
+            }
+        }
+        /* Only now can no event of this batch refer to a retired session */
+        reap();
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+/* nix headers */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/termios.h>
+
+/* Architecture definitions */
+#include "./include/main_memory.h"
+
+/* Utility functions */
+#include "./include/utilities/switch_endian.h"
+#include "./include/utilities/read_image_file.h"
+#include "./include/utilities/terminal_io.h"
+
+/* Execution engines */
+#include "./include/engines/smp.h"
+
+#define PROGRAM_START 0x3000
+
+/*
+    lc3-smp: run an image on several virtual CPUs sharing one memory.
+    Prints the instructions retired by each CPU and the aggregate rate to stderr on exit.
+*/
+
+static struct smp_machine machine;
+
+static void smp_usage(void)
+{
+    printf("lc3-smp [-c cpus] [image-file] ...\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int cpu_count = 2;
+    int i = 1;
+    if( i + 1 < argc && strcmp(argv[i], "-c") == 0 )
+    {
+        cpu_count = (int)strtol(argv[i + 1], NULL, 0);
+        i += 2;
+    }
+    if( i == argc || cpu_count < 1 || cpu_count > SMP_MAX_CPUS )
+    {
+        smp_usage();
+    }
+    for( ; i < argc; ++i )
+    {
+        if( !read_image(argv[i]) )
+        {
+            printf("Failed to load image: %s\n", read_image_error());
+            exit(1);
+        }
+    }
+    memcpy(machine.memory, memory, sizeof(memory));
+
+    int interactive = isatty(STDIN_FILENO);
+    if( interactive )
+    {
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+    }
+
+    smp_init(&machine, cpu_count, PROGRAM_START);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = smp_run(&machine);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if( interactive )
+    {
+        restore_input_buffering();
+    }
+    if( !started )
+    {
+        printf("Failed to start CPUs\n");
+        exit(1);
+    }
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t total = 0;
+    for( int cpu = 0; cpu < cpu_count; ++cpu )
+    {
+        fprintf(stderr, "CPU %d: %llu instructions\n", cpu, (unsigned long long)machine.cpus[cpu].retired);
+        total += machine.cpus[cpu].retired;
+    }
+    fprintf(stderr, "%d CPUs: %llu instructions in %.3f s, %.1f MIPS\n",
+            cpu_count, (unsigned long long)total, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0);
+    return 0;
+}
@@ -0,0 +1,61 @@
+; Parallel benchmark for lc3-smp
+;
+; TOTAL units of register-only work are dealt round-robin to the CPUs, so
+; the CPUs share nothing until they report. Each CPU adds the number of
+; units it did to DONE with the atomic unit and rings CPU 0's doorbell.
+; CPU 0 sleeps on its doorbell until DONE reaches TOTAL and reports.
+;
+; Run time should fall close to 1/N with N CPUs on N free host cores:
+;     lc3-smp -c 1 smp_benchmark.obj
+;     lc3-smp -c 4 smp_benchmark.obj
+
+        .ORIG x3000
+        LDI R1, CPUID_PTR       ; R1 = this CPU
+        LDI R2, COUNT_PTR       ; R2 = number of CPUs
+        AND R3, R3, #0          ; R3 = units done by this CPU
+        ADD R4, R1, #0          ; R4 = unit index, starting at the CPU id
+        LD R6, NEG_TOTAL        ; R6 = -TOTAL
+
+UNIT    ADD R0, R4, R6
+        BRzp REPORT             ; index >= TOTAL: no units left
+        LD R5, INNER
+WORK    ADD R7, R7, R5          ; one unit: INNER iterations of arithmetic
+        AND R7, R7, R4
+        NOT R7, R7
+        ADD R5, R5, #-1
+        BRp WORK
+        ADD R3, R3, #1
+        ADD R4, R4, R2          ; next unit of this CPU
+        BR UNIT
+
+REPORT  LEA R0, DONE            ; DONE += units done, atomically
+        STI R0, ATOMIC_ADDRESS_PTR
+        STI R3, ATOMIC_ADD_PTR
+        AND R0, R0, #0
+        ADD R0, R0, #1          ; ring CPU 0
+        STI R0, DOORBELL_PTR
+        ADD R1, R1, #0
+        BRz WAIT
+        HALT
+
+WAIT    LD R0, DONE             ; CPU 0: wait for every unit
+        ADD R0, R0, R6
+        BRz FINISHED
+        LDI R0, DOORBELL_WAIT_PTR
+        BR WAIT
+
+FINISHED LEA R0, MESSAGE
+        PUTS
+        HALT
+
+CPUID_PTR           .FILL xFE10
+COUNT_PTR           .FILL xFE12
+ATOMIC_ADDRESS_PTR  .FILL xFE14
+ATOMIC_ADD_PTR      .FILL xFE1C
+DOORBELL_PTR        .FILL xFE20
+DOORBELL_WAIT_PTR   .FILL xFE22
+NEG_TOTAL           .FILL #-240
+INNER               .FILL #20000
+DONE                .FILL #0
+MESSAGE             .STRINGZ "SMP benchmark: all 240 units done\n"
+        .END
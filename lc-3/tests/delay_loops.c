@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utilities/delay_loop_solver.h"
+
+/*
+    Checks the closed form delay loops of delay_loop_solver.h against running the loops one
+    instruction at a time: the iteration count across wraps and n/z/p transitions, loops
+    with copied registers, and stopping at the instruction limit on the loop head.
+*/
+
+#define HEAD 0x3000
+
+/* ADD r0, r1, #imm5 and ADD r0, r1, r2 */
+#define ADD_IMM(r0, r1, imm) (uint16_t)(0x1020 | (r0) << 9 | (r1) << 6 | ((imm) & 0x1F))
+#define ADD_REG(r0, r1, r2) (uint16_t)(0x1000 | (r0) << 9 | (r1) << 6 | (r2))
+/* BR back to HEAD from `branch` */
+#define BR_HEAD(flags, branch) (uint16_t)((flags) << 9 | ((HEAD - (branch) - 1) & 0x1FF))
+
+static uint16_t memory[UINT16_MAX + 1];
+static int failures;
+
+static void check(int condition, const char* what)
+{
+    if( !condition )
+    {
+        printf("delay_loops: FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static uint16_t flag_of(uint16_t value)
+{
+    return value == 0 ? FL_ZER : (value >> 15 ? FL_NEG : FL_POS);
+}
+
+/* Iterations until the branch falls through, one at a time. 0 if it has not after `most` */
+static uint64_t count_iterations(uint16_t value, uint16_t step, uint16_t taken, uint64_t most)
+{
+    for( uint64_t iterations = 1; iterations <= most; ++iterations, value += step )
+    {
+        if( !(flag_of(value) & taken) )
+        {
+            return iterations;
+        }
+    }
+    return 0;
+}
+
+/* Run the ADD/BR loop at HEAD for at most `limit` instructions, up to where it falls through */
+static uint64_t step_loop(uint16_t* registers, uint64_t limit)
+{
+    uint64_t executed = 0;
+    while( executed < limit )
+    {
+        uint16_t instruction = memory[registers[R_PC]++];
+        ++executed;
+        if( instruction >> 12 == OP_ADD )
+        {
+            uint16_t r0 = (instruction >> 9) & 0x7;
+            uint16_t r1 = (instruction >> 6) & 0x7;
+            uint16_t added = (instruction >> 5) & 0x1 ? sign_extension(instruction & 0x1F, 5) : registers[instruction & 0x7];
+            registers[r0] = registers[r1] + added;
+            registers[R_COND] = flag_of(registers[r0]);
+        }
+        else if( ((instruction >> 9) & 0x7) & registers[R_COND] )
+        {
+            registers[R_PC] += sign_extension(instruction & 0x1FF, 9);
+        }
+        else
+        {
+            break;
+        }
+    }
+    return executed;
+}
+
+/* Solve the loop at HEAD and compare with stepping it from the same registers */
+static void check_loop(const uint16_t* body, uint16_t length, const uint16_t* start, uint64_t limit, const char* what)
+{
+    memcpy(memory + HEAD, body, length * sizeof(uint16_t));
+    uint16_t solved[R_COUNT];
+    uint16_t stepped[R_COUNT];
+    memcpy(solved, start, sizeof(solved));
+    memcpy(stepped, start, sizeof(stepped));
+    uint64_t elided = delay_loop_solve(memory, solved, HEAD, HEAD + length - 1, limit);
+    if( elided == 0 )
+    {
+        check(memcmp(solved, start, sizeof(solved)) == 0, what);
+        return;
+    }
+    uint64_t executed = step_loop(stepped, elided);
+    check(executed == elided && memcmp(solved, stepped, sizeof(solved)) == 0, what);
+}
+
+int main(void)
+{
+    /* Counting down with BRp, BRzp and BRnp */
+    check(delay_loop_iterations(5, 0xFFFF, FL_POS) == 6, "BRp from 5 down falls through at 0");
+    check(delay_loop_iterations(5, 0xFFFF, FL_POS | FL_ZER) == 7, "BRzp from 5 down falls through at -1");
+    check(delay_loop_iterations(0xFFFE, 1, FL_NEG | FL_POS) == 3, "BRnp from -2 up falls through at 0");
+    /* Wrapping from x7FFF to x8000 and from x8000 to x7FFF */
+    check(delay_loop_iterations(0x7FFE, 1, FL_POS) == 3, "BRp up wraps to negative at x8000");
+    check(delay_loop_iterations(0x8001, 0xFFFF, FL_NEG) == 3, "BRn down wraps to positive at x7FFF");
+    check(delay_loop_iterations(0x7FF0, 0x10, FL_POS | FL_ZER) == 2, "BRzp steps over x7FFF");
+    /* n to z to p: -3 by 2 skips zero, by 1 lands on it */
+    check(delay_loop_iterations(0xFFFD, 2, FL_NEG | FL_ZER) == 3, "BRnz from -3 by 2 falls through at 1");
+    check(delay_loop_iterations(0xFFFD, 1, FL_NEG) == 4, "BRn from -3 by 1 falls through at 0");
+    check(delay_loop_iterations(0, 1, FL_ZER | FL_POS) == 32769, "BRzp from 0 up runs to x8000");
+    /* Loops that never exit or never move */
+    check(delay_loop_iterations(5, 0xFFFF, FL_NEG | FL_ZER | FL_POS) == 0, "BRnzp never falls through");
+    check(delay_loop_iterations(5, 0, FL_POS) == 0, "a counter that does not move never falls through");
+
+    /* Against counting one at a time: any count given must be exact */
+    srand(1);
+    int solved = 0;
+    for( int i = 0; i < 4000; ++i )
+    {
+        uint16_t value = (uint16_t)rand();
+        uint16_t step = i % 4 ? (uint16_t)(rand() % 33 - 16) : (uint16_t)rand();
+        uint16_t taken = (uint16_t)(1 + rand() % 6);
+        uint64_t iterations = delay_loop_iterations(value, step, taken);
+        if( iterations )
+        {
+            ++solved;
+            char what[96];
+            snprintf(what, sizeof(what), "x%04X by x%04X while %d: %llu iterations",
+                     value, step, taken, (unsigned long long)iterations);
+            check(count_iterations(value, step, taken, iterations) == iterations, what);
+        }
+    }
+    check(solved > 3000, "most random loops are solved");
+
+    /* LD R1, COUNT / loop: ADD R1, R1, #-1 / BRp loop, entered with the first iteration done */
+    const uint16_t countdown[] = { ADD_IMM(1, 1, -1), BR_HEAD(FL_POS, HEAD + 1) };
+    uint16_t registers[R_COUNT] = { 0, 99, 0, 0, 0, 0, 0, 0, HEAD, FL_POS };
+    check_loop(countdown, 2, registers, UINT64_MAX, "countdown to the end");
+    memcpy(memory + HEAD, countdown, sizeof(countdown));
+    check(delay_loop_solve(memory, registers, HEAD, HEAD + 1, 51) == 50, "the limit stops after whole iterations");
+    check(registers[1] == 74 && registers[R_PC] == HEAD && registers[R_COND] == FL_POS, "stopped on the loop head");
+    check(delay_loop_solve(memory, registers, HEAD, HEAD + 1, 1) == 0 && registers[1] == 74, "no room for an iteration");
+    check(delay_loop_solve(memory, registers, HEAD, HEAD + 1, UINT64_MAX) == 148, "resume from the head");
+    check(registers[1] == 0 && registers[R_PC] == HEAD + 2 && registers[R_COND] == FL_ZER, "fell through at zero");
+
+    /* Modulo by repeated subtraction: R2 copies the stepping R0 and is what the branch tests */
+    const uint16_t modulo[] = { ADD_REG(0, 0, 1), ADD_IMM(2, 0, 0), BR_HEAD(FL_ZER | FL_POS, HEAD + 2) };
+    const uint16_t dividend[R_COUNT] = { 1000, (uint16_t)-7, 0, 0, 0, 0, 0, 0, HEAD, FL_POS };
+    check_loop(modulo, 3, dividend, UINT64_MAX, "modulo loop");
+    check_loop(modulo, 3, dividend, 100, "modulo loop at the limit");
+
+    /* Not delay loops: a register added in is written, a copy of a copy of itself */
+    const uint16_t feedback[] = { ADD_REG(0, 0, 1), ADD_IMM(1, 1, 1), BR_HEAD(FL_POS, HEAD + 2) };
+    memcpy(memory + HEAD, feedback, sizeof(feedback));
+    memcpy(registers, dividend, sizeof(registers));
+    check(delay_loop_solve(memory, registers, HEAD, HEAD + 2, UINT64_MAX) == 0, "an added register that changes");
+    const uint16_t swap[] = { ADD_IMM(2, 0, 0), ADD_IMM(0, 1, 0), ADD_IMM(1, 2, -1), BR_HEAD(FL_POS, HEAD + 3) };
+    memcpy(memory + HEAD, swap, sizeof(swap));
+    check(delay_loop_solve(memory, registers, HEAD, HEAD + 3, UINT64_MAX) == 0, "registers trading values");
+
+    /* Random bodies of ADDs against stepping them, with and without a limit */
+    for( int i = 0; i < 20000; ++i )
+    {
+        uint16_t body[DELAY_LOOP_MAX_BODY + 1];
+        uint16_t length = (uint16_t)(2 + rand() % 4);
+        for( uint16_t j = 0; j + 1 < length; ++j )
+        {
+            uint16_t r0 = (uint16_t)(rand() % 4);
+            uint16_t r1 = (uint16_t)(rand() % 4);
+            body[j] = rand() % 3 ? ADD_IMM(r0, r1, rand()) : ADD_REG(r0, r1, 4 + rand() % 4);
+        }
+        body[length - 1] = BR_HEAD(1 + rand() % 6, HEAD + length - 1);
+        uint16_t start[R_COUNT] = { 0 };
+        for( int r = 0; r < 8; ++r )
+        {
+            start[r] = (uint16_t)(r < 4 ? rand() : rand() % 64 - 32);
+        }
+        start[R_PC] = HEAD;
+        start[R_COND] = FL_POS;
+        check_loop(body, length, start, i % 2 ? UINT64_MAX : (uint64_t)(rand() % 5000), "random loop");
+    }
+
+    if( failures )
+    {
+        return 1;
+    }
+    printf("delay_loops: ok\n");
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3vm.h"
+
+/*
+    A host embedding liblc3vm, linked against the archive the way an outside program would be.
+    Runs a program through a custom trap, the built-in OUT, a device read and a device write,
+    and checks that a failed image load is reported through lc3vm_load_error(), not printed.
+*/
+
+#define DEVICE_IN 0xFE10
+#define DEVICE_OUT 0xFE12
+
+static const uint16_t program[] = {
+    0x3000,         /* origin */
+    0x2006,         /* LD R0, CHARACTER */
+    0xF040,         /* TRAP x40: the host adds one to R0 */
+    0xF021,         /* OUT */
+    0xA204,         /* LDI R1, INPUT: from the host device */
+    0xB204,         /* STI R1, OUTPUT: to the host device */
+    0xF041,         /* TRAP x41: the host stops the VM */
+    0xF025,         /* HALT */
+    0x0041,         /* CHARACTER: 'A' */
+    DEVICE_IN,      /* INPUT */
+    DEVICE_OUT      /* OUTPUT */
+};
+
+/* Counts R1 down from 1000 before halting */
+static const uint16_t countdown[] = {
+    0x3000,         /* origin */
+    0x2203,         /* LD R1, COUNT */
+    0x127F,         /* ADD R1, R1, #-1 */
+    0x03FE,         /* BRp x3001 */
+    0xF025,         /* HALT */
+    1000            /* COUNT */
+};
+
+struct host
+{
+    char output[64];
+    size_t output_length;
+    unsigned traps;
+    uint16_t written_address;
+    uint16_t written_value;
+};
+
+static int failures;
+
+static void check(int condition, const char* what)
+{
+    if( !condition )
+    {
+        printf("lc3vm_consumer: FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static void host_output(void* context, const uint8_t* bytes, size_t length)
+{
+    struct host* host = context;
+    if( host->output_length + length < sizeof(host->output) )
+    {
+        memcpy(host->output + host->output_length, bytes, length);
+        host->output_length += length;
+    }
+}
+
+static int host_trap(void* context, struct lc3_vm* vm, uint8_t vector)
+{
+    struct host* host = context;
+    ++host->traps;
+    switch(vector)
+    {
+        case 0x40:
+            lc3vm_set_register(vm, LC3VM_R0, lc3vm_get_register(vm, LC3VM_R0) + 1);
+            return LC3VM_TRAP_HANDLED;
+        case 0x41:
+            return LC3VM_TRAP_STOP;
+    }
+    return LC3VM_TRAP_DEFAULT;
+}
+
+static int host_device_read(void* context, uint16_t address, uint16_t* value)
+{
+    (void)context;
+    if( address == DEVICE_IN )
+    {
+        *value = 0x1234;
+        return 1;
+    }
+    return 0;
+}
+
+static int host_device_write(void* context, uint16_t address, uint16_t value)
+{
+    struct host* host = context;
+    if( address == DEVICE_OUT )
+    {
+        host->written_address = address;
+        host->written_value = value;
+        return 1;
+    }
+    return 0;
+}
+
+/* Big endian, as read from an .obj file */
+static void to_image(uint8_t* image, const uint16_t* words, size_t count)
+{
+    for( size_t i = 0; i < count; ++i )
+    {
+        image[2 * i] = (uint8_t)(words[i] >> 8);
+        image[2 * i + 1] = (uint8_t)words[i];
+    }
+}
+
+int main(void)
+{
+    uint8_t image[sizeof(program)];
+    to_image(image, program, sizeof(program) / sizeof(program[0]));
+
+    struct lc3_vm* vm = lc3vm_create();
+    if( !vm )
+    {
+        printf("lc3vm_consumer: out of memory\n");
+        return 1;
+    }
+    struct host host = { { 0 }, 0, 0, 0, 0 };
+    struct lc3vm_callbacks callbacks = { NULL, host_output, host_trap, host_device_read, host_device_write };
+    lc3vm_set_callbacks(vm, &callbacks, &host);
+
+    check(lc3vm_load_image(vm, image, sizeof(image)), "load the program");
+    check(lc3vm_load_error(vm)[0] == '\0', "no load error after a load");
+    check(!lc3vm_load_image(vm, image, sizeof(image)), "a second copy overlaps the first");
+    check(strstr(lc3vm_load_error(vm), "overlaps") != NULL, "the overlap is reported by lc3vm_load_error()");
+
+    check(lc3vm_run(vm, 1000) == LC3VM_STOP_HOST, "the trap callback stops the VM");
+    check(host.output_length == 1 && host.output[0] == 'B', "TRAP x40 handled by the host, then OUT");
+    check(lc3vm_get_register(vm, LC3VM_R1) == 0x1234, "device read");
+    check(host.written_address == DEVICE_OUT && host.written_value == 0x1234, "device write");
+    check(lc3vm_read_memory(vm, DEVICE_OUT) == 0, "a device write does not reach memory");
+
+    check(lc3vm_run(vm, 1000) == LC3VM_STOP_HALT, "resume after the host stop and halt");
+    check(host.output_length == 6 && memcmp(host.output, "BHALT\n", 6) == 0, "HALT output");
+    check(host.traps == 4, "every trap goes through the callback");
+    check(lc3vm_retired(vm) == 7, "instructions retired");
+
+    lc3vm_destroy(vm);
+
+    /* The countdown retires every instruction with its loop elided */
+    uint8_t countdown_image[sizeof(countdown)];
+    to_image(countdown_image, countdown, sizeof(countdown) / sizeof(countdown[0]));
+    vm = lc3vm_create();
+    if( !vm )
+    {
+        printf("lc3vm_consumer: out of memory\n");
+        return 1;
+    }
+    lc3vm_set_callbacks(vm, &callbacks, &host);
+    lc3vm_set_delay_loop_elision(vm, 1);
+    check(lc3vm_load_image(vm, countdown_image, sizeof(countdown_image)), "load the countdown");
+    check(lc3vm_run(vm, 1000) == LC3VM_STOP_LIMIT, "an elided loop stops at the budget");
+    check(lc3vm_retired(vm) == 1000 && lc3vm_get_register(vm, LC3VM_R1) == 1000 - 500, "stopped on a whole iteration");
+    check(lc3vm_run(vm, 10000) == LC3VM_STOP_HALT, "the countdown halts");
+    check(lc3vm_retired(vm) == 2002 && lc3vm_elided(vm) == 1996, "every instruction retired, the loop run twice and elided after that");
+    lc3vm_destroy(vm);
+
+    if( failures )
+    {
+        return 1;
+    }
+    printf("lc3vm_consumer: ok\n");
+    return 0;
+}
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+# Drives the time travel debugger of lc3 on a pseudo terminal. Usage: time_travel.py path/to/lc3
+import os, pty, re, select, struct, sys, tempfile, time
+
+# x3000: ADD R1, R1, #1 / BRnzp x3000
+COUNTER = struct.pack(">HHH", 0x3000, 0x1261, 0x0FFE)
+# x3000: LDI R1, KBSR / BRzp x3000 / LDI R0, KBDR / ADD R2, R2, #1 / RTI (bad opcode: opens the debugger)
+# x3005: xFE00 (KBSR) / xFE02 (KBDR)
+WAIT_FOR_KEY = struct.pack(">8H", 0x3000, 0xA204, 0x07FE, 0xA003, 0x14A1, 0x8000, 0xFE00, 0xFE02)
+
+class Session:
+    def __init__(self, lc3, image):
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.environ["LC3_CHECKPOINT_INTERVAL"] = "1000"
+            os.execv(lc3, [lc3, image])
+        self.output = b""
+
+    def drain(self, seconds):
+        end = time.time() + seconds
+        while time.time() < end:
+            ready, _, _ = select.select([self.fd], [], [], 0.05)
+            if ready:
+                try:
+                    self.output += os.read(self.fd, 4096)
+                except OSError:
+                    return
+
+    def send(self, data, seconds):
+        os.write(self.fd, data)
+        self.drain(seconds)
+
+    def close(self):
+        os.kill(self.pid, 9)
+        os.waitpid(self.pid, 0)
+        return self.output.decode(errors="replace")
+
+def run(lc3, image_bytes, drive):
+    with tempfile.NamedTemporaryFile(suffix=".obj", delete=False) as image:
+        image.write(image_bytes)
+    try:
+        session = Session(lc3, image.name)
+        expected = drive(session)
+        output = session.close()
+    finally:
+        os.unlink(image.name)
+    missing = [line for line in expected if line not in output]
+    for line in missing:
+        print("time_travel: missing '%s'" % line)
+    if missing:
+        print(output)
+    return not missing
+
+def debugger_commands(session):
+    session.drain(0.3)
+    # Ctrl-\ opens the debugger
+    session.send(b"\x1c", 0.5)
+    for command in ["goto 0", "goto 2", "mem x3000 2", "mem x30zz"]:
+        session.send(command.encode() + b"\n", 0.3)
+    return [
+        "instruction 0  PC=x3000  COND=Z",
+        "instruction 2  PC=x3000  COND=P",
+        "R0=x0000  R1=x0001",
+        "x1261 x0FFE",
+        "Not a number: x30zz",
+    ]
+
+def replay_across_input(session):
+    # Thousands of checkpoints are taken while the program polls KBSR for the key
+    session.drain(0.5)
+    session.send(b"a", 0.5)
+    stop = re.search(rb"Bad opcode at instruction (\d+)", session.output)
+    if not stop:
+        return ["Bad opcode at instruction"]
+    # Going back lands on a checkpoint taken during the wait: the key must arrive on the same poll
+    executed = int(stop.group(1))
+    session.send(b"goto %d\n" % (executed - 2), 0.5)
+    return [
+        "instruction %d  PC=x3003  COND=P" % (executed - 2),
+        "R0=x0061  R1=x8000  R2=x0000",
+    ]
+
+def main():
+    lc3 = os.path.abspath(sys.argv[1])
+    ok = run(lc3, COUNTER, debugger_commands)
+    ok = run(lc3, WAIT_FOR_KEY, replay_across_input) and ok
+    if not ok:
+        sys.exit(1)
+    print("time_travel: ok")
+
+main()
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+/* nix headers */
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Utility functions */
+#include "./include/opcodes.h"
+#include "./include/trap_codes.h"
+#include "./include/utilities/live_statistics.h"
+
+/*
+    lc3-top: live statistics of every lc3 running on the host.
+
+    Reads the /lc3-stats-<pid> shared memory segments published by lc3 and refreshes once a
+    second. MIPS and idle time are computed from the difference between two refreshes. Idle
+    time is time blocked in GETC/IN plus time spent spinning on KBSR without a key.
+    Segments left behind by VMs that died without cleaning up are removed.
+*/
+
+#define TOP_MAX_VMS 256
+#define SHM_DIRECTORY "/dev/shm"
+
+struct sample
+{
+    int32_t pid;
+    uint64_t instructions;
+    uint64_t idle_ns;
+    uint64_t taken_ns;
+};
+
+static struct sample previous[TOP_MAX_VMS];
+static int previous_count;
+
+static const char* opcode_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static void top_usage(void)
+{
+    printf("lc3-top [-1] [-d seconds]\n");
+    exit(2);
+}
+
+static const char* trap_name(int vector)
+{
+    switch(vector)
+    {
+        case TRAP_GETC: return "GETC";
+        case TRAP_OUT: return "OUT";
+        case TRAP_PUTS: return "PUTS";
+        case TRAP_IN: return "IN";
+        case TRAP_PUTSP: return "PUTSP";
+        case TRAP_HALT: return "HALT";
+    }
+    return NULL;
+}
+
+static struct sample* find_previous(int32_t pid)
+{
+    for( int i = 0; i < previous_count; ++i )
+    {
+        if( previous[i].pid == pid )
+        {
+            return &previous[i];
+        }
+    }
+    return NULL;
+}
+
+#define LOAD(field) atomic_load_explicit(&(field), memory_order_relaxed)
+
+/* Print one VM. Returns its sample for the next refresh */
+static struct sample show(const struct shared_statistics* s, uint64_t now)
+{
+    struct sample current = { s->pid, LOAD(s->instructions), LOAD(s->idle_ns), now };
+    const struct sample* last = find_previous(s->pid);
+
+    double mips = 0.0;
+    double idle = 0.0;
+    if( last && now > last->taken_ns )
+    {
+        double elapsed = (double)(now - last->taken_ns);
+        mips = (double)(current.instructions - last->instructions) * 1e3 / elapsed;
+        idle = 100.0 * (double)(current.idle_ns - last->idle_ns) / elapsed;
+    }
+    else if( now > s->started_ns )
+    {
+        mips = (double)current.instructions * 1e3 / (double)(now - s->started_ns);
+    }
+
+    printf("%7d %-20.20s %14llu %8.2f %6.1f%% %12llu %10llu %10llu\n",
+           s->pid, s->image, (unsigned long long)current.instructions, mips, idle > 100.0 ? 100.0 : idle,
+           (unsigned long long)LOAD(s->kbsr_polls), (unsigned long long)LOAD(s->bytes_output),
+           (unsigned long long)LOAD(s->write_syscalls));
+
+    printf("        ops:");
+    for( int op = 0; op < 16; ++op )
+    {
+        uint64_t count = LOAD(s->opcodes[op]);
+        if( count )
+        {
+            printf(" %s=%llu", opcode_names[op], (unsigned long long)count);
+        }
+    }
+    printf("\n        traps:");
+    for( int vector = 0; vector < 256; ++vector )
+    {
+        uint64_t count = LOAD(s->traps[vector]);
+        if( count )
+        {
+            const char* name = trap_name(vector);
+            if( name )
+            {
+                printf(" %s=%llu", name, (unsigned long long)count);
+            }
+            else
+            {
+                printf(" x%02X=%llu", vector, (unsigned long long)count);
+            }
+        }
+    }
+    printf("\n");
+    return current;
+}
+
+static void refresh(int clear)
+{
+    DIR* directory = opendir(SHM_DIRECTORY);
+    if( !directory )
+    {
+        printf("Cannot open %s: %s\n", SHM_DIRECTORY, strerror(errno));
+        exit(1);
+    }
+
+    static struct sample current[TOP_MAX_VMS];
+    int count = 0;
+    uint64_t now = statistics_now_ns();
+
+    if( clear )
+    {
+        /* Home the cursor and clear the screen */
+        printf("\033[H\033[2J");
+    }
+    printf("%7s %-20s %14s %8s %7s %12s %10s %10s\n",
+           "PID", "IMAGE", "INSTRUCTIONS", "MIPS", "IDLE", "KBSR-POLLS", "OUT-BYTES", "WRITES");
+
+    struct dirent* entry;
+    while( (entry = readdir(directory)) && count < TOP_MAX_VMS )
+    {
+        if( strncmp(entry->d_name, STATISTICS_PREFIX, strlen(STATISTICS_PREFIX)) != 0 )
+        {
+            continue;
+        }
+        char name[300];
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        /* The PID is in the name: a dead VM's segment is reaped whatever state it was left in */
+        char* end;
+        long pid = strtol(entry->d_name + strlen(STATISTICS_PREFIX), &end, 10);
+        if( *end == '\0' && pid > 0 && kill((pid_t)pid, 0) < 0 && errno == ESRCH )
+        {
+            /* The VM died without removing its segment (abort(), SIGKILL) */
+            shm_unlink(name);
+            continue;
+        }
+        int fd = shm_open(name, O_RDONLY, 0);
+        if( fd < 0 )
+        {
+            continue;
+        }
+        /* A segment still being sized by statistics_open() would fault past its end */
+        struct stat status;
+        if( fstat(fd, &status) < 0 || status.st_size < (off_t)sizeof(struct shared_statistics) )
+        {
+            close(fd);
+            continue;
+        }
+        struct shared_statistics* s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if( s == MAP_FAILED )
+        {
+            continue;
+        }
+        if( s->magic == STATISTICS_MAGIC && s->version == STATISTICS_VERSION )
+        {
+            current[count++] = show(s, now);
+        }
+        munmap(s, sizeof(*s));
+    }
+    closedir(directory);
+
+    if( count == 0 )
+    {
+        printf("No running VMs\n");
+    }
+    memcpy(previous, current, sizeof(struct sample) * count);
+    previous_count = count;
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    int once = 0;
+    unsigned delay = 1;
+    for( int i = 1; i < argc; ++i )
+    {
+        if( strcmp(argv[i], "-1") == 0 )
+        {
+            once = 1;
+        }
+        else if( strcmp(argv[i], "-d") == 0 && i + 1 < argc )
+        {
+            delay = (unsigned)strtoul(argv[++i], NULL, 0);
+        }
+        else
+        {
+            top_usage();
+        }
+    }
+
+    if( once )
+    {
+        refresh(0);
+        return 0;
+    }
+    for(;;)
+    {
+        refresh(1);
+        sleep(delay ? delay : 1);
+    }
+    return 0;
+}
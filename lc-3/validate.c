@@ -0,0 +1,1030 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* nix headers */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/termios.h>
+#include <sys/mman.h>
+
+/* Architecture definitions */
+#include "./include/main_memory.h"
+#include "./include/registers.h"
+
+/* Utility functions */
+#include "./include/utilities/switch_endian.h"
+#include "./include/utilities/read_image_file.h"
+#include "./include/utilities/terminal_io.h"
+
+/* Execution engines */
+#include "./include/engines/reference.h"
+#include "./include/engines/vm.h"
+#include "./include/engines/lockstep.h"
+
+#define PROGRAM_START 0x3000
+
+/*
+    lc3-validate: differential testing of an execution engine against the reference interpreter.
+
+    The reference (include/engines/reference.h) and a candidate engine run the same image on
+    the same input. Execution is cut into blocks ending at every control transfer (BR, JMP,
+    JSR, TRAP). After each block both engines fold their registers, the memory pages either
+    of them wrote during the block and their console output into a rolling hash. The hashes
+    must match after every block.
+
+    On a mismatch both engines are reset and replayed to the start of the failing block, then
+    stepped one instruction at a time with a full state comparison to find the first
+    diverging instruction, which is reported with the complete state of both engines.
+
+    With -r the images are random instruction streams covering every opcode and addressing
+    mode, each fed -i random input streams (by default a full batch for the lockstep engine,
+    one otherwise). A failing program is reproduced with -r <seed> -c 1.
+
+    Every input is validated on its own against a reference run on that input. The lockstep
+    engine runs up to LOCKSTEP_LANES inputs as the lanes of one batch, as lc3-batch does: while
+    one lane is compared, the other lanes run along up to the same instruction count, so the
+    lanes are grouped, diverge and re-converge as they do in a real batch.
+
+    With -d the reference elides delay loops (see include/utilities/delay_loops.h) and the
+    candidate, which does not, must end up in the same state after every block.
+
+    KBSR is not compared: every read of it re-polls the keyboard, so the value it holds
+    between reads is not observable by the program.
+*/
+
+#define VALIDATE_PAGE_SHIFT 8
+#define VALIDATE_PAGE_WORDS (1 << VALIDATE_PAGE_SHIFT)
+#define VALIDATE_PAGES ((UINT16_MAX + 1) / VALIDATE_PAGE_WORDS)
+/* Straight line code is cut into blocks of at most this many instructions */
+#define VALIDATE_BLOCK_LIMIT 1024
+#define VALIDATE_RANDOM_INPUT 4096
+#define VALIDATE_RANDOM_LIMIT 100000
+/* Memory differences printed in a divergence report */
+#define VALIDATE_REPORT_WORDS 16
+
+#define HASH_BASIS 0xCBF29CE484222325ull
+#define HASH_PRIME 0x100000001B3ull
+
+/* Why an engine stopped, common to all engines */
+enum
+{
+    STOP_NONE = 0,
+    STOP_HALT,
+    STOP_BAD_OPCODE,
+    STOP_INPUT
+};
+
+static const char* stop_names[] = { "running", "halted", "bad opcode", "input exhausted" };
+
+struct output_digest
+{
+    uint64_t hash;
+    uint64_t length;
+};
+
+/*
+    Candidate engine.
+    run() executes up to `instructions` instructions and returns a STOP_* reason.
+*/
+struct candidate
+{
+    const char* name;
+    int (*reset)(void);
+    int (*run)(uint64_t instructions);
+    void (*registers)(uint16_t* registers);
+    const uint16_t* (*memory)(void);
+    /* OR the pages written since the last call into `pages` and clear them */
+    void (*take_dirty)(uint64_t* pages);
+    struct output_digest output;
+};
+
+/* Image every run starts from, the keyboard input of every run and the run being validated */
+static uint16_t pristine[UINT16_MAX + 1];
+static uint8_t** inputs;
+static size_t* input_lengths;
+static int input_count;
+static int lane;
+
+static FILE* report;
+
+static uint64_t hash_words(uint64_t hash, const uint16_t* words, size_t count)
+{
+    for( size_t i = 0; i < count; ++i )
+    {
+        hash = (hash ^ words[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+static void digest_bytes(struct output_digest* digest, const uint8_t* bytes, size_t length)
+{
+    for( size_t i = 0; i < length; ++i )
+    {
+        digest->hash = (digest->hash ^ bytes[i]) * HASH_PRIME;
+    }
+    digest->length += length;
+}
+
+/*
+    Hash of the architectural state: registers, KBDR, the memory pages in `pages` and console output.
+    Both engines are hashed over the same set of pages.
+*/
+static uint64_t state_hash(const uint16_t* registers, const uint16_t* memory, const uint64_t* pages, const struct output_digest* output)
+{
+    uint64_t hash = hash_words(HASH_BASIS, registers, R_COUNT);
+    /* memory_read() updates KBDR without marking the device page dirty */
+    hash = hash_words(hash, memory + MMR_KBDR, 1);
+    for( int word = 0; word < VALIDATE_PAGES / 64; ++word )
+    {
+        for( uint64_t bits = pages[word]; bits; bits &= bits - 1 )
+        {
+            uint16_t page = (uint16_t)(word * 64 + __builtin_ctzll(bits));
+            uint16_t first = (uint16_t)(page << VALIDATE_PAGE_SHIFT);
+            hash = (hash ^ page) * HASH_PRIME;
+            if( first == (MMR_KBSR & ~(VALIDATE_PAGE_WORDS - 1)) )
+            {
+                uint16_t offset = MMR_KBSR - first;
+                hash = hash_words(hash, memory + first, offset);
+                hash = hash_words(hash, memory + MMR_KBSR + 1, VALIDATE_PAGE_WORDS - offset - 1);
+            }
+            else
+            {
+                hash = hash_words(hash, memory + first, VALIDATE_PAGE_WORDS);
+            }
+        }
+    }
+    hash = (hash ^ output->hash) * HASH_PRIME;
+    return (hash ^ output->length) * HASH_PRIME;
+}
+
+static int is_control_transfer(uint16_t instruction)
+{
+    switch(instruction >> 12)
+    {
+        case OP_BR:
+        case OP_JMP:
+        case OP_JSR:
+        case OP_TRAP:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+    Reference engine.
+    Its keyboard is STDIN_FILENO, which holds the input stream as a regular file, and its
+    console is a stdout stream whose writes are only digested.
+*/
+static struct output_digest reference_output;
+
+static ssize_t reference_write(void* cookie, const char* bytes, size_t length)
+{
+    (void)cookie;
+    digest_bytes(&reference_output, (const uint8_t*)bytes, length);
+    return (ssize_t)length;
+}
+
+static void reference_reset(void)
+{
+    memcpy(memory, pristine, sizeof(memory));
+    memset(registers, 0, sizeof(registers));
+    registers[R_COND] = FL_ZER;
+    registers[R_PC] = PROGRAM_START;
+    memset(time_travel.dirty, 0, sizeof(time_travel.dirty));
+    time_travel.executed = 0;
+    delay_loops.elided = 0;
+    fflush(stdout);
+    memset(&reference_output, 0, sizeof(reference_output));
+    reference_output.hash = HASH_BASIS;
+    rewind(stdin);
+}
+
+/* Where reference_run() stops short of its budget */
+enum
+{
+    RUN_BUDGET = 0,
+    RUN_BLOCK,      /* after a control transfer */
+    RUN_STEP        /* after one instruction, or one elided delay loop */
+};
+
+/*
+    Execute up to `instructions` instructions, stopping early as `mode` says.
+    *executed receives the number of instructions executed.
+*/
+static int reference_run(uint64_t instructions, int mode, uint64_t* executed)
+{
+    int stop = STOP_NONE;
+    uint64_t count = 0;
+    while( count < instructions )
+    {
+        uint16_t instruction = memory[registers[R_PC]];
+        uint64_t before = time_travel.executed;
+        /* A delay loop is elided no further than the budget */
+        time_travel.next_event = before + (instructions - count);
+        int status = reference_execute();
+        count += time_travel.executed - before;
+        if( feof(stdin) )
+        {
+            /* getchar() hit the end of the input */
+            stop = STOP_INPUT;
+            break;
+        }
+        if( status != REFERENCE_CONTINUE )
+        {
+            stop = status == REFERENCE_HALT ? STOP_HALT : STOP_BAD_OPCODE;
+            break;
+        }
+        if( mode == RUN_STEP || (mode == RUN_BLOCK && is_control_transfer(instruction)) )
+        {
+            break;
+        }
+    }
+    fflush(stdout);
+    *executed = count;
+    return stop;
+}
+
+static void reference_take_dirty(uint64_t* pages)
+{
+    for( int page = 0; page < VALIDATE_PAGES; ++page )
+    {
+        if( time_travel.dirty[page] )
+        {
+            pages[page >> 6] |= 1ull << (page & 63);
+        }
+    }
+    memset(time_travel.dirty, 0, sizeof(time_travel.dirty));
+}
+
+/* Candidate: struct lc3_vm (lc3-fuzz, lc3-server) */
+static struct lc3_vm candidate_vm;
+static size_t candidate_vm_position;
+static struct candidate vm_candidate;
+
+static int vm_candidate_input(void* context)
+{
+    (void)context;
+    return candidate_vm_position < input_lengths[lane] ? inputs[lane][candidate_vm_position++] : -1;
+}
+
+static void vm_candidate_output(void* context, const uint8_t* bytes, size_t length)
+{
+    (void)context;
+    digest_bytes(&vm_candidate.output, bytes, length);
+}
+
+static int vm_candidate_reset(void)
+{
+    memset(&candidate_vm, 0, sizeof(candidate_vm));
+    memcpy(candidate_vm.memory, pristine, sizeof(candidate_vm.memory));
+    vm_reset_registers(&candidate_vm);
+    candidate_vm.input = vm_candidate_input;
+    candidate_vm.output = vm_candidate_output;
+    candidate_vm.stop_on_idle_poll = 1;
+    candidate_vm_position = 0;
+    return 1;
+}
+
+static int vm_candidate_run(uint64_t instructions)
+{
+    switch( vm_run(&candidate_vm, instructions) )
+    {
+        case VM_STOP_HALT: return STOP_HALT;
+        case VM_STOP_BAD_OPCODE: return STOP_BAD_OPCODE;
+        case VM_STOP_INPUT: return STOP_INPUT;
+    }
+    return STOP_NONE;
+}
+
+static void vm_candidate_registers(uint16_t* registers)
+{
+    memcpy(registers, candidate_vm.registers, sizeof(candidate_vm.registers));
+}
+
+static const uint16_t* vm_candidate_memory(void)
+{
+    return candidate_vm.memory;
+}
+
+static void vm_candidate_take_dirty(uint64_t* pages)
+{
+    for( int word = 0; word < VM_PAGES / 64; ++word )
+    {
+        pages[word] |= candidate_vm.dirty[word];
+    }
+    vm_clear_dirty(&candidate_vm);
+}
+
+static struct candidate vm_candidate = {
+    "vm", vm_candidate_reset, vm_candidate_run, vm_candidate_registers,
+    vm_candidate_memory, vm_candidate_take_dirty, { 0, 0 }
+};
+
+/* Candidate: one lane of the lockstep interpreter (lc3-batch), the other inputs in the batch running alongside */
+static struct lockstep_batch* candidate_batch;
+static int candidate_lane;
+static size_t candidate_batch_digested;
+/* The group stepped last and where it goes next, see lockstep_run_lanes() */
+static uint32_t candidate_mask;
+static uint16_t candidate_pc;
+static uint16_t candidate_ceiling;
+static int candidate_next;
+static struct candidate lockstep_candidate;
+
+static int lockstep_candidate_reset(void)
+{
+    if( !candidate_batch )
+    {
+        candidate_batch = aligned_alloc(32, sizeof(struct lockstep_batch));
+        if( !candidate_batch )
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        lockstep_free(candidate_batch);
+    }
+    /* The batch of lc3-batch the validated input would be in */
+    int first = lane - lane % LOCKSTEP_LANES;
+    int lanes = input_count - first < LOCKSTEP_LANES ? input_count - first : LOCKSTEP_LANES;
+    if( !lockstep_init(candidate_batch, lanes, pristine, PROGRAM_START) )
+    {
+        return 0;
+    }
+    for( int l = 0; l < lanes; ++l )
+    {
+        candidate_batch->io[l].input = inputs[first + l];
+        candidate_batch->io[l].input_length = input_lengths[first + l];
+    }
+    candidate_lane = lane - first;
+    candidate_batch_digested = 0;
+    candidate_next = -1;
+    return 1;
+}
+
+static uint64_t lockstep_candidate_retired(int l)
+{
+    return candidate_batch->retired[l] + candidate_batch->counted[l];
+}
+
+/* The lanes in `lanes` that have executed fewer than `target` instructions */
+static uint32_t lockstep_candidate_short(uint32_t lanes, uint64_t target)
+{
+    uint32_t short_of = 0;
+    for( uint32_t m = lanes; m; m &= m - 1 )
+    {
+        if( lockstep_candidate_retired(__builtin_ctz(m)) < target )
+        {
+            short_of |= 1u << __builtin_ctz(m);
+        }
+    }
+    return short_of;
+}
+
+/*
+    Step the batch until the validated lane has executed `instructions` more or stopped.
+    The batch is stepped as lockstep_run() does, following the group while it stays together
+    below the ceiling, but a group is only taken among the lanes short of where the validated
+    lane is going. The other lanes run along no further, and cannot starve it.
+*/
+static int lockstep_candidate_run(uint64_t instructions)
+{
+    struct lockstep_batch* batch = candidate_batch;
+    uint32_t own = 1u << candidate_lane;
+    uint64_t target = lockstep_candidate_retired(candidate_lane) + instructions;
+    while( (batch->running & own) && lockstep_candidate_retired(candidate_lane) < target )
+    {
+        if( candidate_next >= 0 && candidate_next < candidate_ceiling
+            && lockstep_candidate_short(candidate_mask, target) == candidate_mask )
+        {
+            candidate_pc = (uint16_t)candidate_next;
+        }
+        else
+        {
+            uint32_t running = batch->running;
+            batch->running = lockstep_candidate_short(running, target);
+            candidate_mask = lockstep_group(batch, &candidate_pc, &candidate_ceiling);
+            batch->running = running;
+        }
+        candidate_next = lockstep_step(batch, candidate_mask, candidate_pc);
+    }
+
+    struct lane_io* io = &batch->io[candidate_lane];
+    digest_bytes(&lockstep_candidate.output, io->output + candidate_batch_digested, io->output_length - candidate_batch_digested);
+    candidate_batch_digested = io->output_length;
+
+    switch(batch->status[candidate_lane])
+    {
+        case LANE_HALTED: return STOP_HALT;
+        case LANE_BAD_OPCODE: return STOP_BAD_OPCODE;
+        case LANE_INPUT_EXHAUSTED: return STOP_INPUT;
+    }
+    return STOP_NONE;
+}
+
+static void lockstep_candidate_registers(uint16_t* registers)
+{
+    for( int r = 0; r < R_COUNT; ++r )
+    {
+        registers[r] = candidate_batch->registers[r][candidate_lane];
+    }
+}
+
+static const uint16_t* lockstep_candidate_memory(void)
+{
+    return candidate_batch->memory[candidate_lane];
+}
+
+static void lockstep_candidate_take_dirty(uint64_t* pages)
+{
+    for( int word = 0; word < LOCKSTEP_PAGES / 64; ++word )
+    {
+        pages[word] |= candidate_batch->dirty[candidate_lane][word];
+        candidate_batch->dirty[candidate_lane][word] = 0;
+    }
+}
+
+static struct candidate lockstep_candidate = {
+    "lockstep", lockstep_candidate_reset, lockstep_candidate_run, lockstep_candidate_registers,
+    lockstep_candidate_memory, lockstep_candidate_take_dirty, { 0, 0 }
+};
+
+static struct candidate* candidates[] = { &vm_candidate, &lockstep_candidate };
+
+static int reset_engines(struct candidate* candidate)
+{
+    reference_reset();
+    memset(&candidate->output, 0, sizeof(candidate->output));
+    candidate->output.hash = HASH_BASIS;
+    return candidate->reset();
+}
+
+/* Mnemonic and operands of an instruction at `pc` */
+static void disassemble(uint16_t pc, uint16_t instruction, char* text, size_t size)
+{
+    static const char* names[16] = {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+    };
+    int opcode = instruction >> 12;
+    int r0 = (instruction >> 9) & 0x7;
+    int r1 = (instruction >> 6) & 0x7;
+    uint16_t next = pc + 1;
+    switch(opcode)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if( (instruction >> 5) & 0x1 )
+            {
+                snprintf(text, size, "%s R%d, R%d, #%d", names[opcode], r0, r1, (int16_t)sign_extension(instruction & 0x1F, 5));
+            }
+            else
+            {
+                snprintf(text, size, "%s R%d, R%d, R%d", names[opcode], r0, r1, instruction & 0x7);
+            }
+            break;
+        case OP_NOT:
+            snprintf(text, size, "NOT R%d, R%d", r0, r1);
+            break;
+        case OP_BR:
+            snprintf(text, size, "BR%s%s%s x%04X", (instruction >> 11) & 1 ? "n" : "", (instruction >> 10) & 1 ? "z" : "",
+                     (instruction >> 9) & 1 ? "p" : "", (uint16_t)(next + sign_extension(instruction & 0x1FF, 9)));
+            break;
+        case OP_JMP:
+            snprintf(text, size, "JMP R%d", r1);
+            break;
+        case OP_JSR:
+            if( (instruction >> 11) & 1 )
+            {
+                snprintf(text, size, "JSR x%04X", (uint16_t)(next + sign_extension(instruction & 0x7FF, 11)));
+            }
+            else
+            {
+                snprintf(text, size, "JSRR R%d", r1);
+            }
+            break;
+        case OP_LD:
+        case OP_LDI:
+        case OP_ST:
+        case OP_STI:
+        case OP_LEA:
+            snprintf(text, size, "%s R%d, x%04X", names[opcode], r0, (uint16_t)(next + sign_extension(instruction & 0x1FF, 9)));
+            break;
+        case OP_LDR:
+        case OP_STR:
+            snprintf(text, size, "%s R%d, R%d, #%d", names[opcode], r0, r1, (int16_t)sign_extension(instruction & 0x3F, 6));
+            break;
+        case OP_TRAP:
+            snprintf(text, size, "TRAP x%02X", instruction & 0xFF);
+            break;
+        default:
+            snprintf(text, size, "%s", names[opcode]);
+            break;
+    }
+}
+
+/* Full state comparison, KBSR excluded */
+static int states_equal(struct candidate* candidate, int reference_stop, int candidate_stop)
+{
+    uint16_t candidate_registers[R_COUNT];
+    candidate->registers(candidate_registers);
+    const uint16_t* candidate_memory = candidate->memory();
+    return reference_stop == candidate_stop
+        && memcmp(registers, candidate_registers, sizeof(candidate_registers)) == 0
+        && memcmp(memory, candidate_memory, MMR_KBSR * sizeof(uint16_t)) == 0
+        && memcmp(memory + MMR_KBSR + 1, candidate_memory + MMR_KBSR + 1, (UINT16_MAX - MMR_KBSR) * sizeof(uint16_t)) == 0
+        && reference_output.hash == candidate->output.hash
+        && reference_output.length == candidate->output.length;
+}
+
+static void report_divergence(struct candidate* candidate, uint64_t instruction_number, uint16_t pc, uint16_t instruction,
+                              int reference_stop, int candidate_stop)
+{
+    static const char* register_names[R_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND" };
+    char text[64];
+    disassemble(pc, instruction, text, sizeof(text));
+    fprintf(report, "DIVERGENCE at instruction %llu: x%04X  x%04X  %s\n",
+            (unsigned long long)instruction_number, pc, instruction, text);
+
+    uint16_t candidate_registers[R_COUNT];
+    candidate->registers(candidate_registers);
+    const uint16_t* candidate_memory = candidate->memory();
+
+    fprintf(report, "  %-8s %-16s %-16s\n", "", "reference", candidate->name);
+    for( int r = 0; r < R_COUNT; ++r )
+    {
+        fprintf(report, "  %-8s x%04X            x%04X%s\n", register_names[r], registers[r], candidate_registers[r],
+                registers[r] != candidate_registers[r] ? "  <--" : "");
+    }
+    fprintf(report, "  %-8s %-16s %-16s%s\n", "stop", stop_names[reference_stop], stop_names[candidate_stop],
+            reference_stop != candidate_stop ? "  <--" : "");
+    fprintf(report, "  %-8s %-16llu %-16llu%s\n", "output", (unsigned long long)reference_output.length,
+            (unsigned long long)candidate->output.length,
+            reference_output.hash != candidate->output.hash ? "  <--" : "");
+
+    unsigned differences = 0;
+    for( uint32_t address = 0; address <= UINT16_MAX; ++address )
+    {
+        if( address == MMR_KBSR || memory[address] == candidate_memory[address] )
+        {
+            continue;
+        }
+        if( differences++ < VALIDATE_REPORT_WORDS )
+        {
+            fprintf(report, "  mem x%04X x%04X            x%04X  <--\n", address, memory[address], candidate_memory[address]);
+        }
+    }
+    if( differences > VALIDATE_REPORT_WORDS )
+    {
+        fprintf(report, "  ... %u more memory words differ\n", differences - VALIDATE_REPORT_WORDS);
+    }
+}
+
+/*
+    Replay both engines to the start of the block that diverged and step them one
+    instruction at a time up to its end, reporting the first instruction after which
+    their states differ. A delay loop the reference elides is a single step.
+*/
+static void locate_divergence(struct candidate* candidate, uint64_t block_start, uint64_t block_length)
+{
+    uint64_t executed;
+    if( !reset_engines(candidate) )
+    {
+        fprintf(report, "Failed to reset %s\n", candidate->name);
+        return;
+    }
+    reference_run(block_start, RUN_BUDGET, &executed);
+    candidate->run(block_start);
+
+    for( uint64_t i = 0; i < block_length; i += executed )
+    {
+        uint16_t pc = registers[R_PC];
+        uint16_t instruction = memory[pc];
+        int reference_stop = reference_run(block_length - i, RUN_STEP, &executed);
+        int candidate_stop = candidate->run(executed);
+        if( !states_equal(candidate, reference_stop, candidate_stop) )
+        {
+            report_divergence(candidate, block_start + i + executed, pc, instruction, reference_stop, candidate_stop);
+            return;
+        }
+    }
+    fprintf(report, "DIVERGENCE in the block of instructions %llu-%llu that does not reproduce when single stepped\n",
+            (unsigned long long)block_start + 1, (unsigned long long)(block_start + block_length));
+}
+
+/*
+    Run the reference and the candidate side by side for at most `limit` instructions.
+    Returns 1 if they agree, 0 on divergence.
+*/
+static int validate(struct candidate* candidate, uint64_t limit, const char* label)
+{
+    if( !reset_engines(candidate) )
+    {
+        fprintf(report, "Failed to reset %s\n", candidate->name);
+        return 0;
+    }
+
+    uint64_t reference_hash = HASH_BASIS;
+    uint64_t candidate_hash = HASH_BASIS;
+    uint64_t executed = 0;
+    uint64_t blocks = 0;
+    int stop = STOP_NONE;
+    uint16_t candidate_registers[R_COUNT];
+
+    while( executed < limit )
+    {
+        uint64_t budget = limit - executed < VALIDATE_BLOCK_LIMIT ? limit - executed : VALIDATE_BLOCK_LIMIT;
+        uint64_t length;
+        int reference_stop = reference_run(budget, RUN_BLOCK, &length);
+        int candidate_stop = candidate->run(length);
+        if( reference_stop == STOP_INPUT && candidate_stop == STOP_INPUT )
+        {
+            /* The last block read past the end of the input: the engines differ in how they wait for more */
+            stop = STOP_INPUT;
+            break;
+        }
+
+        uint64_t pages[VALIDATE_PAGES / 64] = { 0 };
+        reference_take_dirty(pages);
+        candidate->take_dirty(pages);
+
+        candidate->registers(candidate_registers);
+        reference_hash = (reference_hash ^ state_hash(registers, memory, pages, &reference_output)) * HASH_PRIME;
+        candidate_hash = (candidate_hash ^ state_hash(candidate_registers, candidate->memory(), pages, &candidate->output)) * HASH_PRIME;
+        ++blocks;
+
+        if( reference_hash != candidate_hash || reference_stop != candidate_stop )
+        {
+            fprintf(report, "%s: %s diverged from the reference in block %llu\n", label, candidate->name, (unsigned long long)blocks);
+            locate_divergence(candidate, executed, length);
+            return 0;
+        }
+        executed += length;
+        stop = reference_stop;
+        if( stop != STOP_NONE )
+        {
+            break;
+        }
+    }
+
+    fprintf(report, "%s: %s matches the reference for %llu instructions in %llu blocks (%s)", label, candidate->name,
+            (unsigned long long)executed, (unsigned long long)blocks, stop == STOP_NONE ? "instruction limit" : stop_names[stop]);
+    if( delay_loops.enabled )
+    {
+        fprintf(report, ", %llu of them in delay loops elided by the reference", (unsigned long long)delay_loops.elided);
+    }
+    fprintf(report, "\n");
+    return 1;
+}
+
+/* xorshift64* */
+static uint64_t random_state;
+
+static uint64_t random_next(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+    Random instruction word.
+    Every opcode and addressing mode is generated: ADD/AND in register and immediate mode,
+    JSR and JSRR, JMP including RET, every trap routine plus unassigned vectors, and the
+    unused RTI/RES rarely so that most programs run for a while.
+*/
+static uint16_t random_instruction(void)
+{
+    uint64_t bits = random_next();
+    uint16_t instruction = (uint16_t)bits;
+    uint16_t opcode = instruction >> 12;
+    bits >>= 16;
+    switch(opcode)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if( !((instruction >> 5) & 0x1) )
+            {
+                /* Register mode: bits [4:3] are zero */
+                instruction &= ~0x18;
+            }
+            break;
+        case OP_JSR:
+            if( !((instruction >> 11) & 0x1) )
+            {
+                /* JSRR: only the base register */
+                instruction &= 0xF1C0;
+            }
+            break;
+        case OP_JMP:
+        case OP_NOT:
+            /* JMP: only the base register. NOT: [5:0] are ones */
+            instruction = opcode == OP_JMP ? (instruction & 0xF1C0) : (instruction | 0x3F);
+            break;
+        case OP_TRAP:
+            {
+                /* Mostly the trap routines, HALT rarely */
+                unsigned choice = bits & 0x3F;
+                uint16_t vector = choice < 48 ? TRAP_GETC + choice % 5 : (choice < 50 ? TRAP_HALT : (uint16_t)(bits >> 8));
+                instruction = (uint16_t)(OP_TRAP << 12 | (vector & 0xFF));
+            }
+            break;
+        case OP_RTI:
+        case OP_RES:
+            if( bits & 0xFF )
+            {
+                /* Keep RTI/RES at 1/256 of their share */
+                instruction = (uint16_t)(OP_ADD << 12 | (instruction & 0x0FFF));
+            }
+            break;
+    }
+    return instruction;
+}
+
+/*
+    Fill memory below the device page with a random program and data, and the inputs with random bytes.
+    The program starts at x3004 plus the first input byte, anywhere in the 256 words after it.
+    One word in eight is zero (BR never, and the terminator of strings printed by PUTS/PUTSP),
+    and one in sixty four points at KBSR or KBDR so that LDI/STI reach the keyboard.
+*/
+static void generate_program(uint64_t seed)
+{
+    random_state = seed * 0x9E3779B97F4A7C15ull + 1;
+    memset(pristine, 0, sizeof(pristine));
+    for( uint32_t address = 0; address < MMR_KBSR; ++address )
+    {
+        uint64_t choice = random_next() & 0x3F;
+        if( choice < 8 )
+        {
+            pristine[address] = 0;
+        }
+        else if( choice == 8 )
+        {
+            pristine[address] = (random_next() & 1) ? MMR_KBSR : MMR_KBDR;
+        }
+        else
+        {
+            pristine[address] = random_instruction();
+        }
+    }
+    /* Jump as far in as the first input byte says: runs on different inputs set off apart */
+    pristine[PROGRAM_START] = OP_TRAP << 12 | TRAP_GETC;
+    pristine[PROGRAM_START + 1] = OP_LEA << 12 | R_R1 << 9 | 2;
+    pristine[PROGRAM_START + 2] = OP_ADD << 12 | R_R1 << 9 | R_R1 << 6 | R_R0;
+    pristine[PROGRAM_START + 3] = OP_JMP << 12 | R_R1 << 6;
+    for( int l = 0; l < input_count; ++l )
+    {
+        for( size_t i = 0; i < input_lengths[l]; ++i )
+        {
+            inputs[l][i] = (uint8_t)random_next();
+        }
+    }
+}
+
+/*
+    Make the input of the validated run the reference's keyboard: stdin is reopened on a file holding it.
+    freopen() rather than dup2() so that no stdio buffer of the previous input survives.
+*/
+static int install_input(void)
+{
+    const uint8_t* input = inputs[lane];
+    size_t input_length = input_lengths[lane];
+    char path[] = "/tmp/lc3-validate-XXXXXX";
+    int fd = mkstemp(path);
+    if( fd < 0 )
+    {
+        return 0;
+    }
+    int ok = input_length == 0 || write(fd, input, input_length) == (ssize_t)input_length;
+    close(fd);
+    ok = ok && freopen(path, "rb", stdin) != NULL && fileno(stdin) == STDIN_FILENO;
+    unlink(path);
+    return ok;
+}
+
+/* Read a whole file into a heap buffer. Returns NULL on FAILURE */
+static uint8_t* read_input_file(const char* path, size_t* length)
+{
+    FILE* file = fopen(path, "rb");
+    if( !file )
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* buffer = malloc(size > 0 ? (size_t)size : 1);
+    if( buffer && size > 0 && fread(buffer, 1, (size_t)size, file) != (size_t)size )
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    *length = size > 0 ? (size_t)size : 0;
+    return buffer;
+}
+
+static void validate_usage(void)
+{
+    printf("lc3-validate [-e vm|lockstep] [-n max-instructions] [-d 1] [image-file] ... [-- input-file ...]\n");
+    printf("lc3-validate [-e vm|lockstep] [-n max-instructions] [-d 1] -r seed [-c programs] [-i inputs]\n");
+    exit(2);
+}
+
+/*
+    Validate every input against its own reference run.
+    Returns 1 if they all agree, 0 on the first divergence.
+*/
+static int validate_inputs(struct candidate* candidate, uint64_t limit, const char* name, char** names)
+{
+    for( lane = 0; lane < input_count; ++lane )
+    {
+        char label[256];
+        if( names )
+        {
+            snprintf(label, sizeof(label), "%s: %s", name, names[lane]);
+        }
+        else if( input_count > 1 )
+        {
+            snprintf(label, sizeof(label), "%s input %d", name, lane);
+        }
+        else
+        {
+            snprintf(label, sizeof(label), "%s", name);
+        }
+        if( !install_input() )
+        {
+            fprintf(report, "Failed to create the input file\n");
+            exit(1);
+        }
+        if( !validate(candidate, limit, label) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    struct candidate* candidate = &vm_candidate;
+    uint64_t limit = 0;
+    int random_mode = 0;
+    uint64_t seed = 0;
+    uint64_t programs = 1;
+    int random_inputs = 0;
+    int i = 1;
+    for( ; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--") != 0; i += 2 )
+    {
+        if( i + 1 == argc )
+        {
+            validate_usage();
+        }
+        if( strcmp(argv[i], "-e") == 0 )
+        {
+            candidate = NULL;
+            for( size_t c = 0; c < sizeof(candidates) / sizeof(candidates[0]); ++c )
+            {
+                if( strcmp(argv[i + 1], candidates[c]->name) == 0 )
+                {
+                    candidate = candidates[c];
+                }
+            }
+            if( !candidate )
+            {
+                validate_usage();
+            }
+        }
+        else if( strcmp(argv[i], "-n") == 0 )
+        {
+            limit = strtoull(argv[i + 1], NULL, 0);
+        }
+        else if( strcmp(argv[i], "-r") == 0 )
+        {
+            random_mode = 1;
+            seed = strtoull(argv[i + 1], NULL, 0);
+        }
+        else if( strcmp(argv[i], "-c") == 0 )
+        {
+            programs = strtoull(argv[i + 1], NULL, 0);
+        }
+        else if( strcmp(argv[i], "-i") == 0 )
+        {
+            random_inputs = atoi(argv[i + 1]);
+            if( random_inputs < 1 )
+            {
+                validate_usage();
+            }
+        }
+        else if( strcmp(argv[i], "-d") == 0 )
+        {
+            delay_loops.enabled = atoi(argv[i + 1]) != 0;
+        }
+        else
+        {
+            validate_usage();
+        }
+    }
+
+    /* The report goes to the real stdout, the reference writes its console output to a digest */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    cookie_io_functions_t functions = { NULL, reference_write, NULL, NULL };
+    FILE* console = fopencookie(NULL, "w", functions);
+    if( !report || !console )
+    {
+        printf("Failed to set up the reference console\n");
+        exit(1);
+    }
+
+    if( random_mode )
+    {
+        if( i != argc )
+        {
+            validate_usage();
+        }
+        /* A full batch of inputs for the lockstep engine by default */
+        input_count = random_inputs ? random_inputs : (candidate == &lockstep_candidate ? LOCKSTEP_LANES : 1);
+        inputs = calloc((size_t)input_count, sizeof(*inputs));
+        input_lengths = calloc((size_t)input_count, sizeof(*input_lengths));
+        for( int l = 0; inputs && input_lengths && l < input_count; ++l )
+        {
+            input_lengths[l] = VALIDATE_RANDOM_INPUT;
+            inputs[l] = malloc(VALIDATE_RANDOM_INPUT);
+            if( !inputs[l] )
+            {
+                break;
+            }
+        }
+        if( !inputs || !input_lengths || !inputs[input_count - 1] )
+        {
+            fprintf(report, "Out of memory\n");
+            exit(1);
+        }
+        stdout = console;
+        int failed = 0;
+        for( uint64_t program = 0; program < programs; ++program )
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "seed %llu", (unsigned long long)(seed + program));
+            generate_program(seed + program);
+            if( !validate_inputs(candidate, limit ? limit : VALIDATE_RANDOM_LIMIT, name, NULL) )
+            {
+                failed = 1;
+                break;
+            }
+        }
+        fflush(report);
+        return failed;
+    }
+
+    int images = 0;
+    const char* first_image = argv[i];
+    for( ; i < argc && strcmp(argv[i], "--") != 0; ++i )
+    {
+        if( !read_image(argv[i]) )
+        {
+            fprintf(report, "Failed to load image: %s\n", read_image_error());
+            exit(1);
+        }
+        ++images;
+    }
+    if( images == 0 || i + 1 == argc )
+    {
+        validate_usage();
+    }
+    memcpy(pristine, memory, sizeof(pristine));
+
+    /* No input files: one run with an empty keyboard */
+    char** names = i < argc ? argv + i + 1 : NULL;
+    input_count = names ? argc - i - 1 : 1;
+    inputs = calloc((size_t)input_count, sizeof(*inputs));
+    input_lengths = calloc((size_t)input_count, sizeof(*input_lengths));
+    if( !inputs || !input_lengths )
+    {
+        fprintf(report, "Out of memory\n");
+        exit(1);
+    }
+    for( int l = 0; names && l < input_count; ++l )
+    {
+        inputs[l] = read_input_file(names[l], &input_lengths[l]);
+        if( !inputs[l] )
+        {
+            fprintf(report, "Failed to read input: %s\n", names[l]);
+            exit(1);
+        }
+    }
+
+    stdout = console;
+    int ok = validate_inputs(candidate, limit ? limit : UINT64_MAX, first_image, names);
+    fflush(report);
+    return !ok;
+}